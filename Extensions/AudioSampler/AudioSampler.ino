@@ -5,6 +5,11 @@
  * calculate an 8-bit (8 bands) Fourier transform. Upon request, the 
  * transform is updated and streamed continuously to the main LED
  * controller. 
+ * 
+ * The controller is found by broadcasting a hello message until it 
+ * answers. Hellos continue at a slower rate once paired, so a 
+ * controller that restarts (and forgets its peers) registers this 
+ * extension again. Message formats must match LEDStripDriver/espnow.h.
  */
 
 #include <arduinoFFT.h>
@@ -28,29 +33,63 @@ arduinoFFT FFT = arduinoFFT();
 
 int bands[8] = {0, 0, 0, 0, 0, 0, 0, 0};
 
-// This device's broadcasted ESPNow address
-uint8_t broadcastAddress[] = {0x2F, 0x0E, 0xAC, 0x2B, 0x3C, 0x8F};
+// Broadcast address used to find the controller
+uint8_t broadcastAddress[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// The LED controller's ESPNow address, learned from its hello reply
+uint8_t controllerAddress[6];
+
+// Global copy of controller connection and pair status. Written 
+// from the ESPNow receive callback.
+volatile bool controllerPaired = false;
+unsigned long lastHello = 0;
+
+// Time between hello messages before and after pairing (ms)
+const unsigned long HELLO_INTERVAL = 1000;
+const unsigned long PAIRED_HELLO_INTERVAL = 5000;
+
+#define ESPNOW_PROTOCOL_VERSION 1
+
+// Message types
+#define MSG_HELLO       0x01 // extension announcing itself
+#define MSG_HELLO_ACK   0x02 // controller accepting an extension
+#define MSG_AUDIO_BANDS 0x10 // audio spectrum from the audio extension
+
+// Extension types, sent in MSG_HELLO
+#define EXTENSION_AUDIO 0x01
+
+// Header at the start of every message
+typedef struct __attribute__((packed)) messageHeader {
+  uint8_t version;  // ESPNOW_PROTOCOL_VERSION
+  uint8_t type;     // one of the MSG_ types
+  uint8_t length;   // payload length in bytes, excluding the header
+  uint8_t sequence; // incremented for every message sent
+} messageHeader;
 
-// The LED controller's ESPNow address
-uint8_t controllerAddress[] = {0xAC, 0x67, 0xB2, 0x2A, 0x7A, 0x84};
+// MSG_HELLO and MSG_HELLO_ACK payload
+typedef struct __attribute__((packed)) helloMessage {
+  uint8_t extensionType; // one of the EXTENSION_ types
+} helloMessage;
 
-// Global copy of controller connection and pair status
-bool controllerPaired = false;
-esp_now_peer_info_t controller;
+// MSG_AUDIO_BANDS payload
+typedef struct __attribute__((packed)) audioBandsMessage {
+  uint8_t bands[8]; // Frequency band values (0 - 12), lowest band first
+} audioBandsMessage;
 
 // Wrapper for a single message sent to the controller
-typedef struct message {
-  int FFTBands[8]; // Frequency band values (0 - 12)
-} message;
+typedef struct __attribute__((packed)) audioBandsPacket {
+  messageHeader header;
+  audioBandsMessage payload;
+} audioBandsPacket;
 
-message currentFFT;
+audioBandsPacket currentFFT;
+
+// Sequence number for sent messages
+uint8_t sendSequence = 0;
 
 // Configure WiFi station
 void configWiFi() {
   WiFi.mode(WIFI_STA);
-
-  // Set custom MAC address
-  esp_wifi_set_mac(ESP_IF_WIFI_STA, &broadcastAddress[0]);
 }
 
 // Initialize ESPNow with fallback
@@ -66,16 +105,33 @@ void initESPNow() {
   esp_now_register_recv_cb(onDataReceived);
   esp_now_register_send_cb(onDataSent);
 
-  // Pair with the controller
-  controllerPaired = pairWithController();
+  // Register the broadcast address to send hello messages
+  addPeer(broadcastAddress);
 }
 
-// Connect and register the controller
-bool pairWithController() {
-  Serial.println("Attempting to pair with the controller...");
-  
+// Broadcast a hello message so the controller registers this extension
+void sendHello() {
+  struct __attribute__((packed)) {
+    messageHeader header;
+    helloMessage payload;
+  } hello;
+
+  hello.header.version = ESPNOW_PROTOCOL_VERSION;
+  hello.header.type = MSG_HELLO;
+  hello.header.length = sizeof(helloMessage);
+  hello.header.sequence = sendSequence++;
+  hello.payload.extensionType = EXTENSION_AUDIO;
+
+  if (!controllerPaired)
+    Serial.println("Looking for the controller...");
+
+  esp_now_send(broadcastAddress, (uint8_t *) &hello, sizeof(hello));
+}
+
+// Connect and register a peer
+bool addPeer(const uint8_t *address) {
   // Check if the peer exists
-  bool exists = esp_now_is_peer_exist(controller.peer_addr);
+  bool exists = esp_now_is_peer_exist(address);
   
   if (exists) {
     // Already paired.
@@ -83,11 +139,12 @@ bool pairWithController() {
     return true;
   } else {
     // Not paired. Attempt pairing now.
-    memcpy(controller.peer_addr, controllerAddress, 6);
-    controller.channel = 0;  
-    controller.encrypt = false;
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, address, 6);
+    peerInfo.channel = 0;  
+    peerInfo.encrypt = false;
     
-    esp_err_t addStatus = esp_now_add_peer(&controller);
+    esp_err_t addStatus = esp_now_add_peer(&peerInfo);
     
     if (addStatus == ESP_OK) {
       // Pair success
@@ -118,8 +175,21 @@ bool pairWithController() {
 
 // ESPNow data received callback
 void onDataReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
-  char macStr[18];
-  Serial.println(*data);
+  if (data_len < (int) sizeof(messageHeader))
+    return;
+
+  const messageHeader *header = (const messageHeader *) data;
+
+  if (header -> version != ESPNOW_PROTOCOL_VERSION || header -> type != MSG_HELLO_ACK)
+    return;
+
+  // The controller answered. Send to it directly from now on.
+  if (!controllerPaired && addPeer(mac_addr)) {
+    memcpy(controllerAddress, mac_addr, 6);
+    controllerPaired = true;
+
+    Serial.println("Pair successful");
+  }
 }
 
 // ESPNow data send callback
@@ -147,7 +217,7 @@ void loop() {
   FFT.Compute(vReal, vImag, BLOCK_SIZE, FFT_FORWARD);
   FFT.ComplexToMagnitude(vReal, vImag, BLOCK_SIZE);
   
-  for (int i = 0; i <= 8; i++) {
+  for (int i = 0; i < 8; i++) {
     bands[i] = 0;
   }
 
@@ -168,8 +238,28 @@ void loop() {
     }
   }
 
+  // Keep announcing, quickly until the controller answers, then 
+  // slowly in case it restarts
+  if (millis() - lastHello >= (controllerPaired ? PAIRED_HELLO_INTERVAL : HELLO_INTERVAL)) {
+    sendHello();
+    lastHello = millis();
+  }
+
+  if (!controllerPaired) {
+    delay(20);
+    return;
+  }
+
   // Send the result to the controller
-  memcpy(currentFFT.FFTBands, bands, 8*sizeof(int));
+  currentFFT.header.version = ESPNOW_PROTOCOL_VERSION;
+  currentFFT.header.type = MSG_AUDIO_BANDS;
+  currentFFT.header.length = sizeof(audioBandsMessage);
+  currentFFT.header.sequence = sendSequence++;
+
+  for (int i = 0; i < 8; i++) {
+    currentFFT.payload.bands[i] = constrain(bands[i], 0, 255);
+  }
+
   esp_err_t result = esp_now_send(controllerAddress, (uint8_t *) &currentFFT, sizeof(currentFFT));
 
   /*
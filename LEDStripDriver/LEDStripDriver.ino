@@ -11,6 +11,14 @@
  *  - /animations/get: Returns all available animations
  *  - /animations/select?id=[int animationId]: Start playing the animation
  *    with id animationId
+ * Batched binary commands (see commandProtocol.h) are accepted as 
+ * websocket binary messages on /api/stream and as the body of 
+ * POST /api/batch
+ * 
+ * ~ Boot ~
+ * LEDs and the last selected animation come up first in setup(). WiFi, 
+ * mDNS, OTA and the web server are started in the background by the 
+ * boot state machine in loop() as the network becomes ready.
  * 
  * ~ Configuration ~
  * Edit config.h to set NeoPixel, WiFi and web server parameters.
@@ -28,10 +36,13 @@
 #include <EEPROM.h>
 #include <SPIFFS.h>
 #include <WiFi.h>
+#include <atomic>
 
 #include "config.h"
 #include "espnow.h"
 #include "animations.h"
+#include "jsonWriter.h"
+#include "commandProtocol.h"
 
 // Create webserver and DNS server objects
 AsyncWebServer webServer(SERVER_PORT);
@@ -46,15 +57,25 @@ AsyncWiFiManager wifiManager(&webServer, &dnsServer);
 // Task handler for animation
 TaskHandle_t currentTaskHandler = NULL;
 
-// This device's broadcasted MAC address
-uint8_t broadcastAddress[] = {0xAC, 0x67, 0xB2, 0x2A, 0x7A, 0x84};
+// Queue of command batches from the web handlers to the control task
+QueueHandle_t commandQueue = NULL;
+
+/**
+ * Boot stages. LEDs and the saved animation come up synchronously in
+ * setup(), everything that depends on the network is started from 
+ * loop() as it becomes ready. See updateBoot().
+ */
+enum bootStage {
+  BOOT_WIFI_CONNECTING, // waiting for the saved network
+  BOOT_WIFI_PORTAL,     // no connection, config portal is open
+  BOOT_SERVICES,        // connected, starting network services
+  BOOT_READY            // everything is running
+};
 
-// The audio extension's MAC address
-uint8_t audioAddress[] = {0x2F, 0x0E, 0xAC, 0x2B, 0x3C, 0x8F};
+bootStage currentBootStage = BOOT_WIFI_CONNECTING;
 
-// Global copy of audio device connection and pair status
-esp_now_peer_info_t audioextension;
-bool audioPaired = false;
+// Time at which the current boot stage was entered (ms)
+unsigned long bootStageStart = 0;
 
 /*  *  *  *  *  *  *  *  *  * System Status *  *  *  *  *  *  *  */
 
@@ -66,11 +87,25 @@ struct systemStatus {
   unsigned short int selectedAnimationId; // id of the the currently selected animation
 };
 
-// Current system status
+// Current system status. Only changed by the control task.
 systemStatus currentStatus = {
   false, 0
 };
 
+// Last status published by the control task, packed into one word
+// so other tasks always read a consistent snapshot
+std::atomic<uint32_t> publishedStatus(0);
+
+// Status once every queued command has been applied. Used to answer 
+// requests before the control task gets to them, so quick successive 
+// requests (e.g. two toggles) see each other's effect.
+systemStatus queuedStatus = {
+  false, 0
+};
+
+// Serialises enqueuing, so the queue order matches queuedStatus
+SemaphoreHandle_t queuedStatusMutex = NULL;
+
 /**
  * Function to set status
  */
@@ -80,15 +115,56 @@ void setSystemStatus(bool powerOn, int selectedAnimationId) {
 }
 
 /**
- * Function to return the current status as a JSON string
+ * Function to publish the current status for other tasks to read
  */
-String getSystemStatus() {
-  String message = "{\"status\": {";
-    message += "\"powerOn\": " + String(currentStatus.powerOn) + ", ";
-    message += "\"selectedAnimationId\": " + String(currentStatus.selectedAnimationId);
-  message += "}}";
+void publishSystemStatus() {
+  publishedStatus.store(
+    ((uint32_t) currentStatus.selectedAnimationId << 16) | currentStatus.powerOn
+  );
+}
+
+/**
+ * Function to read the last published status
+ */
+systemStatus getPublishedStatus() {
+  uint32_t packed = publishedStatus.load();
 
-  return message;
+  systemStatus status = {
+    (bool) (packed & 1), (unsigned short int) (packed >> 16)
+  };
+
+  return status;
+}
+
+/**
+ * Function to write a status as a JSON object
+ */
+void writeSystemStatus(JsonWriter &json, const systemStatus &status) {
+  json.beginObject();
+    json.beginObject("status");
+      json.add("powerOn", (int) status.powerOn);
+      json.add("selectedAnimationId", (unsigned int) status.selectedAnimationId);
+      json.add("freeHeap", (unsigned long) ESP.getFreeHeap());
+
+      const powerMetrics& power = strip.GetPowerMetrics();
+      json.beginObject("power");
+        json.add("estimatedMilliamps", (unsigned long) power.lastEstimateMa);
+        json.add("framesShown", (unsigned long) power.framesShown);
+        json.add("framesLimited", (unsigned long) power.framesLimited);
+      json.endObject();
+    json.endObject();
+  json.endObject();
+}
+
+/**
+ * Function to send a status to the client
+ */
+void sendSystemStatus(AsyncWebServerRequest *request, const systemStatus &status) {
+  AsyncResponseStream *response = request -> beginResponseStream("text/json");
+  JsonWriter json(*response);
+
+  writeSystemStatus(json, status);
+  request -> send(response);
 }
 
 /*  *  *  *  *  *  *  *  *  * System Status *  *  *  *  *   *  *  */
@@ -101,8 +177,7 @@ String getSystemStatus() {
  */
 void configModeCallback (AsyncWiFiManager *wifiManager) {
   // Set status LED to yellow
-  strip.SetPixelColor(0, RgbColor(255, 255, 0));
-  strip.Show();
+  strip.SetStatusColor(RgbColor(255, 255, 0));
 
   Serial.println("Entered config mode");
   Serial.println(WiFi.softAPIP());
@@ -110,50 +185,56 @@ void configModeCallback (AsyncWiFiManager *wifiManager) {
 }
 
 /**
- * Connect to preconfigured WiFi network using ESPAsyncWiFiManager.
- * If there is no network configured, an access point is created.
+ * Start connecting to the preconfigured WiFi network without blocking.
+ * Progress is polled from the boot state machine in loop().
  */
-void connectWifi() {
-  // Set custom MAC address
-  esp_wifi_set_mac(ESP_IF_WIFI_STA, &broadcastAddress[0]);
-  
+void beginWifi() {
+  WiFi.mode(WIFI_STA);
+
   wifiManager.setAPCallback(configModeCallback);
 
-  if (!wifiManager.autoConnect()) {
-    // Set status LED to red
-    strip.SetPixelColor(0, RgbColor(255, 0, 0));
-    strip.Show();
-    
-    Serial.println("WiFi connection failed");
+  // Connect using the saved credentials, if any
+  WiFi.begin();
+}
 
-    if(BLOCK_UNTIL_CONNECTED) {
-      Serial.print("Retrying in ");
-      Serial.print(CONNECT_TIMEOUT);
-      Serial.println(" seconds");
-      
-      delay(CONNECT_TIMEOUT * 1000);
-      
-      while (!wifiManager.autoConnect()) {
-        Serial.println("Retrying...");
-        delay(CONNECT_TIMEOUT * 1000); 
-      }
-    } else {
-      return;
-    }
-  }
+/**
+ * Open the ESPAsyncWiFiManager config portal without blocking.
+ * The portal is serviced by wifiManager.loop() from the boot state machine.
+ */
+void startConfigPortal() {
+  // Set status LED to red
+  strip.SetStatusColor(RgbColor(255, 0, 0));
+
+  Serial.println("WiFi connection failed");
 
+  wifiManager.startConfigPortalModeless(HOSTNAME, NULL);
+}
+
+/**
+ * Shut down the config portal once connected. The portal's handlers 
+ * are removed from the shared web server so the app's own handlers 
+ * take over, and its access point is closed.
+ */
+void closeConfigPortal() {
+  webServer.reset();
+  dnsServer.stop();
+
+  WiFi.softAPdisconnect(true);
+  WiFi.mode(WIFI_STA);
+}
+
+/**
+ * Called once the WiFi connection is up
+ */
+void onWifiConnected() {
   Serial.print("IP Address: ");
   Serial.println(WiFi.localIP());
   
   Serial.print("MAC Address: ");
   Serial.println(WiFi.macAddress());
 
-  strip.SetPixelColor(0, RgbColor(0, 255, 0));
-  strip.Show();
-
-  // Optionally start mDNS responder
-  if (USE_MDNS)
-    startMDNS();
+  // Set status LED to green
+  strip.SetStatusColor(RgbColor(0, 255, 0));
 }
 
 /*  *  *  *  *  *  *  *  *  *  * WiFi *  *  *  *  *  *  *  *  *  */
@@ -176,11 +257,7 @@ void initESPNow() {
 
 // ESPNow data received callback
 void onDataReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
-  memcpy(&currentFFT, data, sizeof(currentFFT));
-
-  for (int i = 0; i < 8; i++) {
-    Serial.println(currentFFT.FFTBands[i]);
-  }
+  dispatchMessage(mac_addr, data, data_len);
 }
 
 // ESPNow data send callback
@@ -217,13 +294,8 @@ void startOTA() {
   ArduinoOTA.onStart([]() {
     Serial.println("OTA start");
 
-    // End the current animation task
-    if(currentTaskHandler != NULL) {
-      vTaskDelete(currentTaskHandler);
-      currentTaskHandler = NULL;
-    }
-    
-    setAllPixels(black);
+    // End the current animation and black out the strip
+    enqueueCommand(CMD_POWER, POWER_STATE_OFF);
   });
   
   ArduinoOTA.onEnd([]() {
@@ -300,6 +372,9 @@ void startWebServer() {
       handleRequest(request);
     });
 
+  // Batched binary commands arrive as the request body
+  webServer.on("/api/batch", HTTP_POST, handleBatchRequest, NULL, handleBatchBody);
+
   // Link supporting javascript
   webServer.on("/main.js", HTTP_GET, [](AsyncWebServerRequest *request) {
     request->send(SPIFFS, "/main.js", "text/javascript");
@@ -332,7 +407,7 @@ void startWebServer() {
 void handleRequest(AsyncWebServerRequest *request) {
   digitalWrite(LED_BUILTIN, 1);
 
-  String endpoint = request -> url();
+  const String &endpoint = request -> url();
   struct endpointTableEntry *thisEndpointEntry = endpointTable;
 
   // Look up the endpoint
@@ -345,6 +420,9 @@ void handleRequest(AsyncWebServerRequest *request) {
         // 405
         handleWrongMethod(request);
       }
+
+      digitalWrite(LED_BUILTIN, 0);
+      return;
     }
   }   
 
@@ -364,63 +442,59 @@ void handleNotFound(AsyncWebServerRequest *request) {
     return;
   }
   
-  String message = "404 Not Found\n\n";
-  message += "URI: ";
-  message += request -> url();
-  message += "\nMethod: ";
-  message += (request -> method() == HTTP_GET) ? "GET" : "POST";
-  message += "\nParameters: ";
-  message += request -> params();
-  message += "\n";
-  
-  for (uint8_t i = 0; i < request -> params(); i++) {
-    AsyncWebParameter* param = request -> getParam(i);
-    message += " " + param -> name() + ": " + param -> value() + "\n";
-  }
-  
-  request -> send(404, "text/plain", message);
+  sendError(request, 404, "404 Not Found");
 }
 
 /**
  * Returns a 405 "method not allowed" error to the client
  */
 void handleWrongMethod(AsyncWebServerRequest *request) {
-  String message = "405 Method Not Allowed\n\n";
-  message += "URI: ";
-  message += request -> url();
-  message += "\nMethod: ";
-  message += (request -> method() == HTTP_GET) ? "GET" : "POST";
-  message += "\nParameters: ";
-  message += request -> params();
-  message += "\n";
-  
-  for (uint8_t i = 0; i < request -> params(); i++) {
-    AsyncWebParameter* param = request -> getParam(i);
-    message += " " + param -> name() + ": " + param -> value() + "\n";
-  }
-  
-  request -> send(405, "text/plain", message);
+  sendError(request, 405, "405 Method Not Allowed");
+}
+
+/**
+ * Returns a 503 "service unavailable" error to the client when the 
+ * command queue is full
+ */
+void handleBusy(AsyncWebServerRequest *request) {
+  sendError(request, 503, "503 Service Unavailable");
 }
 
 /**
  * Returns a 403 "forbidden" error to the client
  */
 void handleForbidden(AsyncWebServerRequest *request) {
-  String message = "403 Forbidden\n\n";
-  message += "URI: ";
-  message += request -> url();
-  message += "\nMethod: ";
-  message += (request -> method() == HTTP_GET) ? "GET" : "POST";
-  message += "\nParameters: ";
-  message += request -> params();
-  message += "\n";
+  sendError(request, 403, "403 Forbidden");
+}
+
+/**
+ * Sends a plain text error describing the request, streamed 
+ * directly into the response
+ */
+void sendError(AsyncWebServerRequest *request, int code, const char * title) {
+  AsyncResponseStream *response = request -> beginResponseStream("text/plain");
+  response -> setCode(code);
+
+  response -> print(title);
+  response -> print("\n\nURI: ");
+  response -> print(request -> url());
+  response -> print("\nMethod: ");
+  response -> print((request -> method() == HTTP_GET) ? "GET" : "POST");
+  response -> print("\nParameters: ");
+  response -> print(request -> params());
+  response -> print("\n");
   
   for (uint8_t i = 0; i < request -> params(); i++) {
     AsyncWebParameter* param = request -> getParam(i);
-    message += " " + param -> name() + ": " + param -> value() + "\n";
+
+    response -> print(" ");
+    response -> print(param -> name());
+    response -> print(": ");
+    response -> print(param -> value());
+    response -> print("\n");
   }
   
-  request -> send(405, "text/plain", message);
+  request -> send(response);
 }
 
 /*  *  *  *  *  *  *  *  *  *  * Web Server *  *  *  *  *  *  *  *  * */
@@ -444,6 +518,29 @@ void handleSocketEvent(
   } else if(type == WS_EVT_DISCONNECT){
     // Client disconnected
     Serial.println("Client disconnected");
+  } else if(type == WS_EVT_DATA){
+    AwsFrameInfo * info = (AwsFrameInfo *) arg;
+
+    // Binary messages carry command frames
+    if (info -> opcode != WS_BINARY)
+      return;
+
+    uint8_t ack[COMMAND_ACK_SIZE];
+
+    if (info -> final && info -> index == 0 && info -> len == len) {
+      // Whole message in one piece
+      uint16_t sequence;
+      uint8_t result = processCommandFrame(data, len, sequence);
+
+      encodeCommandAck(sequence, result, ack);
+    } else if (info -> final && info -> index + len == info -> len) {
+      // Last piece of a fragmented message. Frames must fit in one.
+      encodeCommandAck(0, COMMAND_TOO_LARGE, ack);
+    } else {
+      return;
+    }
+
+    client -> binary(ack, COMMAND_ACK_SIZE);
   }
 }
 
@@ -471,62 +568,42 @@ void handleReset(AsyncWebServerRequest *request) {
  * API endpoint to get current status
  */
 void handleGetStatus(AsyncWebServerRequest *request) {
-  request -> send(200, "text/json", getSystemStatus());
+  sendSystemStatus(request, getPublishedStatus());
 }
 
 /**
  * API endpoint to power on the LED strip
  */
 void handlePowerOn(AsyncWebServerRequest *request) {
-  // Ignore if already on
-  if (currentStatus.powerOn) {
-    request -> send(200, "text/json", getSystemStatus());
-    return;
-  }
-
-  // Power on
-  currentStatus.powerOn = true;
-
-  // Restart animation
-  int animationId = currentStatus.selectedAnimationId;
-
-  if (animationId > 0) {
-    xTaskCreate(
-      animationTable[animationId-1].handler,
-      animationTable[animationId-1].name,
-      1024, // Stack size (bytes)
-      NULL, // Parameter to pass
-      1,    // Task priority (high)
-      &currentTaskHandler  // Task handle
-    );
-  }
-
-  // Send the response
-  request -> send(200, "text/json", getSystemStatus());
+  handlePowerCommand(request, POWER_STATE_ON);
 }
 
 /**
  * API endpoint to power off the LED strip
  */
 void handlePowerOff(AsyncWebServerRequest *request) {
-  // Ignore if already off
-  if (! currentStatus.powerOn) {
-    request -> send(200, "text/json", getSystemStatus());
+  handlePowerCommand(request, POWER_STATE_OFF);
+}
+
+/**
+ * API endpoint to toggle power
+ */
+void handlePowerToggle(AsyncWebServerRequest *request) {
+  handlePowerCommand(request, POWER_STATE_TOGGLE);
+}
+
+/**
+ * Queue a power command and respond with the resulting status
+ */
+void handlePowerCommand(AsyncWebServerRequest *request, uint8_t state) {
+  systemStatus status;
+
+  if (! enqueueCommandBatch(singleCommand(CMD_POWER, state, 0, 0), status)) {
+    handleBusy(request);
     return;
   }
-  
-  // End the current animation task
-  currentStatus.powerOn = false;
-  if(currentTaskHandler != NULL) {
-    vTaskDelete(currentTaskHandler);
-    currentTaskHandler = NULL;
-  }
 
-  // Black out all pixels
-  setAllPixels(black);
-
-  // Send the response
-  request -> send(200, "text/json", getSystemStatus());
+  sendSystemStatus(request, status);
 }
 
 /**
@@ -536,13 +613,7 @@ void handleSetEffect(AsyncWebServerRequest *request) {
   int params = request -> params();
 
   String type;
-  int r, g, b;
-
-  // End the current animation task
-  if(currentTaskHandler != NULL) {
-    vTaskDelete(currentTaskHandler);
-    currentTaskHandler = NULL;
-  }
+  int r = 0, g = 0, b = 0;
 
   // Parse request
   for(int i=0; i < params; i++) {
@@ -569,24 +640,19 @@ void handleSetEffect(AsyncWebServerRequest *request) {
     }
   }
 
-  // Construct the effect color from request parameters
-  RgbColor effectColor = RgbColor(r, g, b);
-
-  // Show the color
-  setAllPixels(effectColor);
+  // Queue the effect color from request parameters
+  commandBatch batch = singleCommand(
+    CMD_SET_COLOR, constrain(r, 0, 255), constrain(g, 0, 255), constrain(b, 0, 255)
+  );
 
-  request -> send(200, "text/json", getSystemStatus());
-}
+  systemStatus status;
 
-/**
- * API endpoint to toggle power
- */
-void handlePowerToggle(AsyncWebServerRequest *request) {
-  if (currentStatus.powerOn) {
-    handlePowerOff(request);
-  } else {
-    handlePowerOn(request);
+  if (! enqueueCommandBatch(batch, status)) {
+    handleBusy(request);
+    return;
   }
+
+  sendSystemStatus(request, status);
 }
 
 /**
@@ -603,62 +669,394 @@ void handleSelectAnimation(AsyncWebServerRequest *request) {
     if (parameter -> name() == "id") {
       // Found the ID parameter. Look up the selection.
       animationId = parameter -> value().toInt();
-      struct animationTableEntry *thisAnimationEntry = animationTable;
+      struct animationTableEntry *thisAnimationEntry = findAnimation(animationId);
       
-      for ( ; thisAnimationEntry -> id != NULL ; thisAnimationEntry++ ) {
-        if ( animationId == thisAnimationEntry -> id ) {
-          // Valid animation
-          if (animationId != currentStatus.selectedAnimationId)
-            setCurrentAnimation(animationId);
-          
-          request -> send(
-            200, 
-            "text/json", 
-            "{\"result\": {" 
-              "\"id\": " + String(animationId) + ", "
-              "\"name\": \"" + thisAnimationEntry -> name + "\", "
-              "\"error\": null"
-            "}}"
-          );
-    
+      if (thisAnimationEntry != NULL) {
+        // Valid animation
+        systemStatus status;
+
+        if (! enqueueCommandBatch(singleCommand(CMD_SELECT_ANIMATION, animationId, 0, 0), status)) {
+          handleBusy(request);
           return;
         }
+        
+        sendAnimationResult(request, 200, animationId, thisAnimationEntry -> name, NULL);
+  
+        return;
       }
     }
     
     // Invalid animation ID received
-    request -> send(
-      400, 
-      "text/json", 
-      "{\"result\": {"
-        "\"id\": " + String(animationId) + ", "
-        "\"error\": \"Invalid animation ID\""
-      "}}"
-    );
+    sendAnimationResult(request, 400, animationId, NULL, "Invalid animation ID");
   }
 }
 
+/**
+ * Sends the result of an animation selection to the client
+ */
+void sendAnimationResult(
+  AsyncWebServerRequest *request, 
+  int code, 
+  int animationId, 
+  const char * name, 
+  const char * error
+){
+  AsyncResponseStream *response = request -> beginResponseStream("text/json");
+  response -> setCode(code);
+  JsonWriter json(*response);
+
+  json.beginObject();
+    json.beginObject("result");
+      json.add("id", animationId);
+
+      if (name != NULL)
+        json.add("name", name);
+
+      json.add("error", error);
+    json.endObject();
+  json.endObject();
+
+  request -> send(response);
+}
+
 /**
  * API endpoint to retrieve all available animations
  */
 void handleGetAnimations(AsyncWebServerRequest *request) {
   struct animationTableEntry *thisAnimationEntry = animationTable;
+
+  AsyncResponseStream *response = request -> beginResponseStream("text/json");
+  JsonWriter json(*response);
   
-  String message = "{\"animations\": [";
-    for ( ; thisAnimationEntry -> id != NULL ; thisAnimationEntry++ ) {
-      message += "{";
-        message += "\"id\": " + String(thisAnimationEntry -> id) + ",";
-        message += "\"name\": \"" + String(thisAnimationEntry -> name) + "\"";
-      message += "},";
-    }
-  message.remove(message.length()-1);
-  message += "]}";
+  json.beginObject();
+    json.beginArray("animations");
+      for ( ; thisAnimationEntry -> id != NULL ; thisAnimationEntry++ ) {
+        json.beginObject();
+          json.add("id", thisAnimationEntry -> id);
+          json.add("name", thisAnimationEntry -> name);
+        json.endObject();
+      }
+    json.endArray();
+  json.endObject();
   
-  request->send(200, "text/json", message);
+  request -> send(response);
+}
+
+/**
+ * API endpoint for batched binary commands. Called once the whole 
+ * request has arrived. The frame is handled in handleBatchBody(), 
+ * which leaves its acknowledgement in the request's _tempObject. 
+ * Requests without one never reached the body handler (e.g. form 
+ * encoded bodies, which go to the parameter parser, or an empty 
+ * body) and are answered as malformed.
+ */
+void handleBatchRequest(AsyncWebServerRequest *request) {
+  uint8_t *ack = (uint8_t *) request -> _tempObject;
+
+  if (ack == NULL) {
+    uint8_t malformed[COMMAND_ACK_SIZE];
+    encodeCommandAck(0, COMMAND_MALFORMED, malformed);
+
+    sendCommandAck(request, malformed);
+    return;
+  }
+
+  sendCommandAck(request, ack);
+}
+
+/**
+ * Receives the body of a batch request and queues the frame. The 
+ * acknowledgement is sent by handleBatchRequest().
+ */
+void handleBatchBody(
+  AsyncWebServerRequest *request, 
+  uint8_t *data, 
+  size_t len, 
+  size_t index, 
+  size_t total
+){
+  if (index + len != total)
+    return;
+
+  // Freed by the request when it is destroyed. Without it the frame 
+  // is not applied and the request is answered as malformed.
+  uint8_t *ack = (uint8_t *) malloc(COMMAND_ACK_SIZE);
+
+  if (ack == NULL)
+    return;
+
+  uint16_t sequence = 0;
+  uint8_t result = COMMAND_TOO_LARGE;
+
+  // Frames must arrive in one piece
+  if (index == 0)
+    result = processCommandFrame(data, len, sequence);
+
+  encodeCommandAck(sequence, result, ack);
+  request -> _tempObject = ack;
+}
+
+/**
+ * Sends a binary command acknowledgement to the client
+ */
+void sendCommandAck(AsyncWebServerRequest *request, const uint8_t *ack) {
+  AsyncResponseStream *response = request -> beginResponseStream("application/octet-stream");
+  response -> setCode(ack[3] == COMMAND_OK ? 200 : 400);
+  response -> write(ack, COMMAND_ACK_SIZE);
+
+  request -> send(response);
 }
 
 /*  *  *  *  *  *  *  *  *  *  * Route Handlers *  *  *  *  *  *  *   */
 
+/*  *  *  *  *  *  *  *  *  *  * Control *  *  *  *  *  *  *  *  *  * */
+
+/**
+ * Create a task to run an animation, ending the current one
+ */
+void startAnimationTask(int animationId) {
+  stopAnimationTask();
+
+  struct animationTableEntry *thisAnimationEntry = findAnimation(animationId);
+
+  if (thisAnimationEntry == NULL)
+    return;
+
+  xTaskCreate(
+    thisAnimationEntry -> handler,
+    thisAnimationEntry -> name,
+    1024, // Stack size (bytes)
+    NULL, // Parameter to pass
+    1,    // Task priority (high)
+    &currentTaskHandler  // Task handle
+  );
+}
+
+/**
+ * End the current animation task, if any
+ */
+void stopAnimationTask() {
+  if (currentTaskHandler != NULL) {
+    vTaskDelete(currentTaskHandler);
+    currentTaskHandler = NULL;
+
+    // The task may have been part way through a frame
+    strip.RecomputeChannelSum();
+  }
+}
+
+/**
+ * Create the command queue and start the control task, which 
+ * applies every command queued by the web handlers
+ */
+void startControlTask() {
+  commandQueue = xQueueCreate(COMMAND_QUEUE_LENGTH, sizeof(commandBatch));
+  queuedStatusMutex = xSemaphoreCreateMutex();
+
+  queuedStatus = currentStatus;
+  publishSystemStatus();
+
+  xTaskCreate(
+    controlTask,
+    "Control",
+    4096, // Stack size (bytes)
+    NULL, // Parameter to pass
+    2,    // Task priority (above animations)
+    NULL  // Task handle
+  );
+}
+
+/**
+ * Control task. Applies queued command batches one at a time and 
+ * publishes the resulting status. While no animation is running it 
+ * also shows status LED changes, which animations otherwise pick up 
+ * on their next frame.
+ */
+void controlTask(void * pvParameters) {
+  (void) pvParameters;
+
+  commandBatch batch;
+
+  while (true) {
+    if (xQueueReceive(commandQueue, &batch, 100 / portTICK_PERIOD_MS) == pdTRUE) {
+      applyCommandBatch(batch);
+      publishSystemStatus();
+    } else if (currentTaskHandler == NULL) {
+      strip.Show();
+    }
+  }
+}
+
+/**
+ * Queue a validated batch for the control task without blocking.
+ * Returns false if the queue is full. On success, queued is set to 
+ * the status once this and every earlier queued batch are applied.
+ */
+bool enqueueCommandBatch(const commandBatch &batch, systemStatus &queued) {
+  if (commandQueue == NULL)
+    return false;
+
+  xSemaphoreTake(queuedStatusMutex, portMAX_DELAY);
+
+  bool sent = xQueueSend(commandQueue, &batch, 0) == pdTRUE;
+
+  if (sent)
+    queuedStatus = projectStatus(queuedStatus, batch);
+
+  queued = queuedStatus;
+
+  xSemaphoreGive(queuedStatusMutex);
+
+  return sent;
+}
+
+/**
+ * Queue a single command. Returns false if the queue is full.
+ */
+bool enqueueCommand(uint8_t opcode, uint8_t operand) {
+  systemStatus queued;
+  return enqueueCommandBatch(singleCommand(opcode, operand, 0, 0), queued);
+}
+
+/**
+ * Build a batch holding one command
+ */
+commandBatch singleCommand(uint8_t opcode, uint8_t first, uint8_t second, uint8_t third) {
+  commandBatch batch;
+
+  batch.sequence = 0;
+  batch.count = 1;
+  batch.commands[0].opcode = opcode;
+  batch.commands[0].operands[0] = first;
+  batch.commands[0].operands[1] = second;
+  batch.commands[0].operands[2] = third;
+
+  return batch;
+}
+
+/**
+ * A status once a batch has been applied to it. Must match the 
+ * power and animation changes made by applyCommandBatch().
+ */
+systemStatus projectStatus(systemStatus status, const commandBatch &batch) {
+  for (uint8_t i = 0; i < batch.count; i++) {
+    const command &cmd = batch.commands[i];
+
+    if (cmd.opcode == CMD_POWER) {
+      if (cmd.operands[0] == POWER_STATE_TOGGLE)
+        status.powerOn = ! status.powerOn;
+      else
+        status.powerOn = cmd.operands[0] == POWER_STATE_ON;
+    } else if (cmd.opcode == CMD_SELECT_ANIMATION) {
+      status.selectedAnimationId = cmd.operands[0];
+    }
+  }
+
+  return status;
+}
+
+/**
+ * Apply a validated batch as one change. The commands are first 
+ * folded, in order, into the final power, animation and display 
+ * state, which is then applied once: one render, at most one 
+ * animation task restart and at most one EEPROM commit. Intermediate 
+ * states are never shown.
+ */
+void applyCommandBatch(const commandBatch &batch) {
+  // What the strip should show once the batch is applied
+  enum {
+    DISPLAY_UNCHANGED, // leave the strip as it is
+    DISPLAY_OFF,       // black out the strip
+    DISPLAY_ANIMATION, // (re)start the selected animation
+    DISPLAY_COLOR      // show a solid color
+  } display = DISPLAY_UNCHANGED;
+
+  bool powerOn = currentStatus.powerOn;
+  unsigned short int animationId = currentStatus.selectedAnimationId;
+  RgbColor color;
+
+  for (uint8_t i = 0; i < batch.count; i++) {
+    const command &cmd = batch.commands[i];
+
+    switch (cmd.opcode) {
+      case CMD_POWER: {
+        bool target = (cmd.operands[0] == POWER_STATE_TOGGLE) ? 
+          ! powerOn : cmd.operands[0] == POWER_STATE_ON;
+
+        // Ignore if already in that state
+        if (target != powerOn) {
+          powerOn = target;
+          display = powerOn ? DISPLAY_ANIMATION : DISPLAY_OFF;
+        }
+        break;
+      }
+
+      case CMD_SELECT_ANIMATION:
+        if (cmd.operands[0] != animationId) {
+          animationId = cmd.operands[0];
+
+          // A new animation only starts if powered on
+          if (powerOn)
+            display = DISPLAY_ANIMATION;
+        }
+        break;
+
+      case CMD_SET_COLOR:
+        color = RgbColor(cmd.operands[0], cmd.operands[1], cmd.operands[2]);
+        display = DISPLAY_COLOR;
+        break;
+    }
+  }
+
+  currentStatus.powerOn = powerOn;
+
+  if (animationId != currentStatus.selectedAnimationId) {
+    currentStatus.selectedAnimationId = animationId;
+    saveAnimationId(animationId);
+  }
+
+  switch (display) {
+    case DISPLAY_OFF:
+      stopAnimationTask();
+      setAllPixels(black);
+      break;
+
+    case DISPLAY_ANIMATION:
+      // Cleared pixels are shown with the animation's first frame
+      stopAnimationTask();
+      clearPixels();
+      startAnimationTask(animationId);
+      break;
+
+    case DISPLAY_COLOR:
+      stopAnimationTask();
+      setAllPixels(color);
+      break;
+
+    default:
+      break;
+  }
+}
+
+/**
+ * Decode a binary command frame and queue it if every command is 
+ * valid. Returns the result code to acknowledge the frame with.
+ */
+uint8_t processCommandFrame(const uint8_t *data, size_t len, uint16_t &sequence) {
+  commandBatch batch;
+  uint8_t result = decodeCommandBatch(data, len, batch);
+
+  systemStatus queued;
+
+  if (result == COMMAND_OK && ! enqueueCommandBatch(batch, queued))
+    result = COMMAND_BUSY;
+
+  sequence = batch.sequence;
+  return result;
+}
+
+/*  *  *  *  *  *  *  *  *  *  * Control *  *  *  *  *  *  *  *  *  * */
+
 /*  *  *  *  *  *  *  *  *  *  * EEPROM *  *  *  *  *  *  *  *  *  *  */
 
 /*
@@ -696,29 +1094,28 @@ void setCurrentAnimation(unsigned short int animationId) {
   currentStatus.selectedAnimationId = animationId;
 
   // Save to flash memory
-  EEPROM.write(0, animationId);
-  EEPROM.commit();
+  saveAnimationId(animationId);
 
   // Stop here if powered off
   if (! currentStatus.powerOn)
     return;
 
   // End the current animation task
-  if (currentTaskHandler != NULL)
-    vTaskDelete(currentTaskHandler);
+  stopAnimationTask();
 
   // Clear the strip
   setAllPixels(black);
 
   // Create new task to run the animation
-  xTaskCreate(
-    animationTable[animationId-1].handler,
-    animationTable[animationId-1].name,
-    1024, // Stack size (bytes)
-    NULL, // Parameter to pass
-    1,    // Task priority (high)
-    &currentTaskHandler  // Task handle
-  );
+  startAnimationTask(animationId);
+}
+
+/*
+ * Save the ID of the selected animation to flash memory
+ */
+void saveAnimationId(unsigned short int animationId) {
+  EEPROM.write(0, animationId);
+  EEPROM.commit();
 }
 
 /*  *  *  *  *  *  *  *  *  *  * EEPROM *  *  *  *  *  *  *  *  *  *  */
@@ -753,6 +1150,79 @@ void startSPIFFS() {
 
 /*  *  *  *  *  *  *  *  *  *  * SPIFFS *  *  *  *  *  *  *  *  *  *  */
 
+/*  *  *  *  *  *  *  *  *  *  * Boot *  *  *  *  *  *  *  *  *  *  */
+
+/**
+ * Log a boot timeline entry with the time since power-on
+ */
+void logBootStage(const char * stage) {
+  Serial.printf("[boot %6lu ms] %s\n", millis(), stage);
+}
+
+/**
+ * Move to the next boot stage
+ */
+void setBootStage(bootStage stage) {
+  currentBootStage = stage;
+  bootStageStart = millis();
+}
+
+/**
+ * Advance the boot state machine. Called on every loop() and 
+ * never blocks.
+ */
+void updateBoot() {
+  switch (currentBootStage) {
+    case BOOT_WIFI_CONNECTING:
+      if (WiFi.status() == WL_CONNECTED) {
+        setBootStage(BOOT_SERVICES);
+      } else if (millis() - bootStageStart >= CONNECT_TIMEOUT * 1000UL) {
+        startConfigPortal();
+        logBootStage("Config portal open");
+        setBootStage(BOOT_WIFI_PORTAL);
+      }
+      break;
+
+    case BOOT_WIFI_PORTAL:
+      wifiManager.loop();
+
+      if (WiFi.status() == WL_CONNECTED) {
+        closeConfigPortal();
+        logBootStage("Config portal closed");
+        setBootStage(BOOT_SERVICES);
+      }
+      break;
+
+    case BOOT_SERVICES:
+      onWifiConnected();
+      logBootStage("WiFi connected");
+
+      // Optionally start mDNS responder
+      if (USE_MDNS) {
+        startMDNS();
+        logBootStage("mDNS ready");
+      }
+
+      // Set up OTA updates
+      startOTA();
+      logBootStage("OTA ready");
+
+      // Start the web server
+      startWebServer();
+      logBootStage("Web server ready");
+
+      setBootStage(BOOT_READY);
+      break;
+
+    case BOOT_READY:
+      // OTA updates must be handled in the main thread
+      ArduinoOTA.handle();
+      break;
+  }
+}
+
+/*  *  *  *  *  *  *  *  *  *  * Boot *  *  *  *  *  *  *  *  *  *  */
+
 void setup() {
   #ifdef DEBUG
   Serial.begin(115200);
@@ -762,28 +1232,33 @@ void setup() {
 
   // Initialize the NeoPixel interface
   initLEDs();
-
-  // Start up the filesystem, format if needed
-  startSPIFFS();
+  logBootStage("LEDs ready");
 
   // Load last animation, if one was set
   initEEPROMAndGetLastAnimation();
+  logBootStage("Animation resumed");
+
+  // Hand control of the strip to the control task
+  startControlTask();
+  logBootStage("Control task ready");
+
+  // Start up the filesystem, format if needed
+  startSPIFFS();
+  logBootStage("SPIFFS ready");
   
-  // Connect to WiFi
-  connectWifi();
+  // Start connecting to WiFi in the background
+  beginWifi();
+  logBootStage("WiFi started");
 
-  // Initialize ESPNow
+  // ESPNow only needs the radio, not a connection
   initESPNow();
+  logBootStage("ESPNow ready");
 
-  // Set up OTA updates
-  startOTA();
-
-  // Start the web server
-  startWebServer();
+  setBootStage(BOOT_WIFI_CONNECTING);
 }
 
 void loop() {
-  // OTA updates must be handled in the main thread. All other 
-  // execution is task-based.
-  ArduinoOTA.handle();
+  // Network services are brought up by the boot state machine. All 
+  // other execution is task-based.
+  updateBoot();
 }
@@ -13,6 +13,8 @@
 #include <NeoPixelAnimator.h>
 #include <NeoPixelBus.h>
 
+#include "powerLimitedBus.h"
+#include "pixelMap.h"
 #include "config.h"
 
 // Create RGB colors to be used by animations
@@ -26,13 +28,16 @@ RgbColor purple (SATURATION/2, 0, SATURATION);
 RgbColor white  (SATURATION);
 RgbColor black  (0);
 
-// Create the NeoPixelBus strip object
-NeoPixelBus<NeoGrbFeature, Neo800KbpsMethod> strip(LED_COUNT, LED_PIN);
+// Create the NeoPixelBus strip object, limited to the power budget
+PowerLimitedBus<NeoGrbFeature, Neo800KbpsMethod> strip(LED_COUNT, LED_PIN);
 
 /** 
  * Initialize the NeoPixel interface
  */
 void initLEDs() {
+  initPixelMap();
+
+  strip.SetStatusPixel(0);
   strip.Begin();
   strip.Show();
 }
@@ -41,13 +46,53 @@ void initLEDs() {
  * Use this function to set all pixels to a color
  */
 void setAllPixels(RgbColor color) {
-  for (int count = START_LED; count <= LED_COUNT; count++) {
-    strip.SetPixelColor(count, color); 
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    strip.SetPixelColor(pixelIndex[pixel], color); 
   }   
   
   strip.Show();
 }
 
+/**
+ * Set all pixels to black without showing them. The strip is cleared 
+ * by the next frame shown.
+ */
+void clearPixels() {
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    strip.SetPixelColor(pixelIndex[pixel], black);
+  }
+}
+
+/**
+ * Set every pixel at a position along the layout. Positions outside 
+ * the layout are ignored.
+ */
+void setPixelsAtPosition(int position, RgbColor color) {
+  if (position < 0 || position >= mapLength)
+    return;
+
+  for (uint16_t i = positionStart[position]; i < positionStart[position + 1]; i++) {
+    strip.SetPixelColor(pixelIndex[positionPixels[i]], color);
+  }
+}
+
+/**
+ * Set every pixel within a distance of the centre of the layout
+ */
+void setPixelsWithinDistance(uint16_t distance, RgbColor color) {
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    if (pixelDistance[pixel] <= distance)
+      strip.SetPixelColor(pixelIndex[pixel], color);
+  }
+}
+
+/**
+ * Whether a pixel lies in the first half of the layout
+ */
+bool inFirstHalf(uint16_t pixel) {
+  return pixelPosition[pixel] < mapLength / 2;
+}
+
 
 /*  *  *  *  *  *  *  *  *  NeoPixelAnimator support  *  *  *  *  *  *  *  *  *  */
 
@@ -102,9 +147,9 @@ void BlendAnimUpdate(const AnimationParam& param) {
         param.progress);
 
     // apply the color to the strip
-    for (uint16_t pixel = START_LED; pixel < LED_COUNT; pixel++)
+    for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++)
     {
-        strip.SetPixelColor(pixel, updatedColor);
+        strip.SetPixelColor(pixelIndex[pixel], updatedColor);
     }
 }
 
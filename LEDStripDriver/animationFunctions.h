@@ -15,6 +15,9 @@
 #include "Arduino.h"
 
 #include "animationFunctionHelpers.h"
+#include "espnow.h"
+#include "spectrum.h"
+#include "particles.h"
 #include "config.h"
 
 /**
@@ -31,17 +34,17 @@ void christmasRGDance(void * pvParameters) {
   RgbColor dimWhite = RgbColor(20);
 
   // Startup animation
-  for (int pixelIndex = START_LED; pixelIndex <= LED_COUNT; pixelIndex++) {
-    if (pixelIndex % 2 == 0) {
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    if (pixelPosition[pixel] % 2 == 1) {
       if (evenIndex % 2 == 0) {
-        strip.SetPixelColor(pixelIndex, red);
+        strip.SetPixelColor(pixelIndex[pixel], red);
       } else {
-        strip.SetPixelColor(pixelIndex, green);
+        strip.SetPixelColor(pixelIndex[pixel], green);
       }
 
       evenIndex++;
     } else {
-      strip.SetPixelColor(pixelIndex, dimWhite);
+      strip.SetPixelColor(pixelIndex[pixel], dimWhite);
     }
    
     strip.Show();
@@ -54,23 +57,23 @@ void christmasRGDance(void * pvParameters) {
   
   // Main animation loop
   while (true) {
-    for (int pixelIndex = START_LED; pixelIndex <= LED_COUNT; pixelIndex++) {
-      if (pixelIndex % 2 == 0) {
+    for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+      if (pixelPosition[pixel] % 2 == 1) {
         if (evenIndex % 2 == 0) {
           if (swapRG)
-            strip.SetPixelColor(pixelIndex, green);
+            strip.SetPixelColor(pixelIndex[pixel], green);
           else
-            strip.SetPixelColor(pixelIndex, red);
+            strip.SetPixelColor(pixelIndex[pixel], red);
         } else {
           if (swapRG)
-            strip.SetPixelColor(pixelIndex, red);
+            strip.SetPixelColor(pixelIndex[pixel], red);
           else
-            strip.SetPixelColor(pixelIndex, green);
+            strip.SetPixelColor(pixelIndex[pixel], green);
         }
 
         evenIndex++;
       } else {
-        strip.SetPixelColor(pixelIndex, dimWhite);
+        strip.SetPixelColor(pixelIndex[pixel], dimWhite);
       }
     }
 
@@ -92,21 +95,11 @@ void copLightsAlternating(void * pvParameters) {
 
   // Whether to set red or blue first
   bool swapped = true;
-  
-  // Index for middle pixel
-  int median = (LED_COUNT + START_LED) / 2;
 
   // Startup animation
-  // Turn first half red
-  for (int count = START_LED; count <= median; count++) {
-    strip.SetPixelColor(count, red);
-    vTaskDelay(5 / portTICK_PERIOD_MS);
-    strip.Show();
-  }
-
-  // Turn second half blue
-  for (int count = median; count <= LED_COUNT; count++) {
-    strip.SetPixelColor(count, blue);
+  // Turn first half red and second half blue
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    strip.SetPixelColor(pixelIndex[pixel], inFirstHalf(pixel) ? red : blue);
     vTaskDelay(5 / portTICK_PERIOD_MS);
     strip.Show();
   }
@@ -129,14 +122,9 @@ void copLightsAlternating(void * pvParameters) {
     setAllPixels(white);
     vTaskDelay(200 / portTICK_PERIOD_MS);
     
-    // Set first half of strip
-    for (int count = START_LED; count <= median; count++) {
-      strip.SetPixelColor(count, firstColor);
-    }
-  
-    // Set second half of strip
-    for (int count = median; count <= LED_COUNT; count++) {
-      strip.SetPixelColor(count, secondColor);
+    // Set each half of the strip
+    for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+      strip.SetPixelColor(pixelIndex[pixel], inFirstHalf(pixel) ? firstColor : secondColor);
     }
 
     strip.Show();
@@ -151,27 +139,24 @@ void copLightsAlternating(void * pvParameters) {
 void copLightsLineOut(void * pvParameters) {
   (void) pvParameters;
 
-  // Current pixel being changed
-  int pixelIndex = START_LED;
-
-  // Whether to set red or blue first
-  bool swapped = true;
+  // Current position of the line heads
+  int position = 0;
   
-  // Index for middle pixel
-  int median = (LED_COUNT + START_LED) / 2;
+  // Middle position of the layout
+  int median = mapLength / 2;
   int lineSize = 36; 
 
   // Startup animation
   // Red Line Out
-  for (int count = START_LED; count <= median; count++) {
-    strip.SetPixelColor(count, red);
+  for (int count = 0; count < median; count++) {
+    setPixelsAtPosition(count, red);
     vTaskDelay(5 / portTICK_PERIOD_MS);
     strip.Show();
   }
 
   // Blue Line Out
-  for (int count = median; count <= LED_COUNT; count++) {
-    strip.SetPixelColor(count, blue);
+  for (int count = median; count < mapLength; count++) {
+    setPixelsAtPosition(count, blue);
     vTaskDelay(5 / portTICK_PERIOD_MS);
     strip.Show();
   }   
@@ -182,36 +167,26 @@ void copLightsLineOut(void * pvParameters) {
 
   // Main animation loop
   while (true) {
-    static RgbColor firstColor;
-    static RgbColor secondColor;
-  
-    if(pixelIndex >= median){
-      int NegCount = median;
-      
-      for (int count = median; count > median - lineSize / 2; count--) { 
-        strip.SetPixelColor(count - 1, white);
-        strip.SetPixelColor(NegCount, white);
+    if (position >= median) {
+      // Flash white from the middle out
+      for (int radius = 0; radius < lineSize / 2; radius++) { 
+        setPixelsWithinDistance(radius, white);
         strip.Show();
-        NegCount++;
         vTaskDelay(1 / portTICK_PERIOD_MS);
       }
      
       setAllPixels(black);
-      pixelIndex = START_LED;
+      position = 0;
     }
 
-    // Calculate the end of each line, constrain to within bounds of the strip
-    int rLineEnd = constrain(pixelIndex - lineSize / 2, START_LED, median - lineSize / 2);
-    int bLineEnd = constrain(LED_COUNT - pixelIndex + lineSize / 2, START_LED, LED_COUNT);
-
-    // Update pixels
-    strip.SetPixelColor(pixelIndex, red);
-    strip.SetPixelColor(LED_COUNT - pixelIndex, blue);
-    strip.SetPixelColor(rLineEnd, black);
-    strip.SetPixelColor(bLineEnd, black);
+    // Draw the head of each line and erase the end of its tail
+    setPixelsAtPosition(position, red);
+    setPixelsAtPosition(mapLength - 1 - position, blue);
+    setPixelsAtPosition(position - lineSize / 2, black);
+    setPixelsAtPosition(mapLength - 1 - position + lineSize / 2, black);
     
     strip.Show();
-    pixelIndex++;
+    position++;
   }
 }
 
@@ -225,9 +200,9 @@ void halloweenOrange(void * pvParameters) {
   RgbColor orange(74, 20, 0);
   bool swap = false;
 
-  for (int count = START_LED; count <= LED_COUNT; count += LineSize * 2) {
+  for (int count = 0; count < mapLength; count += LineSize * 2) {
     for (int LineCount = count; LineCount <= count + LineSize; LineCount++) {
-      strip.SetPixelColor(LineCount, orange);
+      setPixelsAtPosition(LineCount, orange);
       vTaskDelay(5 / portTICK_PERIOD_MS);
       strip.Show();
     }
@@ -236,24 +211,19 @@ void halloweenOrange(void * pvParameters) {
   // Main animation loop
   while (true) {
     for (int brightness = 74; brightness >= 0; brightness-=4) {
-      for (int count = START_LED; count <= LED_COUNT; count += LineSize * 2) {
-        for (int LineCount = count; LineCount <= count + LineSize; LineCount++) {
-          if (swap) {
-            int SwappedBrightness = 74 - brightness;
-            strip.SetPixelColor(LineCount, RgbColor(SwappedBrightness, SwappedBrightness/4, 0));
-          } else {
-            strip.SetPixelColor(LineCount, RgbColor(brightness, brightness/4, 0));
-          }       
-        }  
-              
-        for (int SecondLineCount = count + LineSize; SecondLineCount <= count + LineSize * 2; SecondLineCount++) {
-          if (!swap) {
-            int SwappedBrightness = 74 - brightness;
-            strip.SetPixelColor(SecondLineCount, RgbColor(SwappedBrightness, SwappedBrightness/4, 0));
-          } else {
-            strip.SetPixelColor(SecondLineCount, RgbColor(brightness, brightness/4, 0));
-          }    
-        }      
+      int SwappedBrightness = 74 - brightness;
+      RgbColor dimming = RgbColor(brightness, brightness/4, 0);
+      RgbColor brightening = RgbColor(SwappedBrightness, SwappedBrightness/4, 0);
+
+      // Alternate lines fade in opposite directions
+      for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+        bool firstLine = pixelPosition[pixel] % (LineSize * 2) < LineSize;
+
+        if (firstLine != swap) {
+          strip.SetPixelColor(pixelIndex[pixel], dimming);
+        } else {
+          strip.SetPixelColor(pixelIndex[pixel], brightening);
+        }
       }
 
       strip.Show();
@@ -290,139 +260,97 @@ void copLightsMix(void * pvParameters) {
 }
 
 /**
- * Simulated thunderstorm with random rainfall and lightning
+ * Simulated thunderstorm with random rainfall and lightning.
+ * Raindrops are particles that land on a random pixel and fade
+ * back into the background.
  */
 void rainyDay(void * pvParameters) {
   (void) pvParameters;
 
   RgbColor thisWhite = RgbColor(5);
-  
+  RgbColor raindrop = RgbColor(0, 0, 40);
 
-  int LightningFrequency = 20;
-  int count = START_LED;
+  const int frameTime = 20;         // ms per frame
+  const int dropLifetime = 40;      // frames for a drop to fade out
+  const int lightningFrames = 500;  // frames between lightning strikes
+  int count = 0;
+
+  resetParticles(thisWhite);
 
   // Startup animation
-  for (int count = START_LED; count <= LED_COUNT; count++) {
-    strip.SetPixelColor(count, thisWhite);
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    strip.SetPixelColor(pixelIndex[pixel], thisWhite);
     vTaskDelay(5 / portTICK_PERIOD_MS);
     strip.Show();
   }
 
   // Main animation loop
   while (true) {
-    if (count % LightningFrequency == 0) {
+    if (++count >= lightningFrames) {
       // Single lightning flash
-      setAllPixels(black);
-      
       setAllPixels(yellow);
-    
-      strip.Show();
       vTaskDelay(50 / portTICK_PERIOD_MS);
-      
-      setAllPixels(thisWhite); 
-    }
-  
-    if (count % LightningFrequency * 2 == 0) {
+
+      setAllPixels(thisWhite);
+      vTaskDelay(frameTime / portTICK_PERIOD_MS);
+
       // Double lightning flash
-      setAllPixels(black);
-      
       setAllPixels(yellow);
-    
-      strip.Show();
       vTaskDelay(50 / portTICK_PERIOD_MS);
-      
-      setAllPixels(white); 
-      strip.Show();
+
+      setAllPixels(white);
       vTaskDelay(10 / portTICK_PERIOD_MS);
-  
-      setAllPixels(black);
-      
+
       setAllPixels(yellow);
-    
-      strip.Show();
       vTaskDelay(50 / portTICK_PERIOD_MS);
-      
-      setAllPixels(thisWhite); 
-  
-      count = START_LED;
+
+      setAllPixels(thisWhite);
+
+      count = 0;
     }
-    
-    int Pixel1Index = random(START_LED, LED_COUNT);
-    int Pixel2Index = random(START_LED, LED_COUNT);
-    int Pixel3Index = random(START_LED, LED_COUNT);
-    
-    for (int count = 40; count >= 15; count--) {
-       strip.SetPixelColor(Pixel1Index, RgbColor(0, 0, count));
-       strip.SetPixelColor(Pixel2Index, RgbColor(0, 0, count));
-       strip.SetPixelColor(Pixel3Index, RgbColor(0, 0, count));
-       
-       strip.Show(); 
+
+    // On average one new drop per frame
+    for (int drops = random(3); drops > 0; drops--) {
+      spawnParticle(random(MAPPED_PIXEL_COUNT), 0, raindrop, dropLifetime, 0, PARTICLE_FADE);
     }
-  
-    strip.SetPixelColor(Pixel1Index, thisWhite);
-    strip.SetPixelColor(Pixel2Index, thisWhite);
-    strip.SetPixelColor(Pixel3Index, thisWhite);
-    
-    strip.Show();
-  
-    count++;
-    vTaskDelay(500 / portTICK_PERIOD_MS);
+
+    updateParticles();
+    drawParticles();
+    showParticles();
+
+    vTaskDelay(frameTime / portTICK_PERIOD_MS);
   }
 }
 
 /**
- * The super mellow green and yellow animation
+ * The super mellow green and yellow animation. A yellow comet with
+ * a long tail bounces from end to end over a green background.
  */
  void melloYello(void * pvParameters) {
   (void) pvParameters;
 
-  int count = START_LED;
-  int loopdirection = 0;
-
   RgbColor thisGreen(0, 15, 0);
+  RgbColor thisYellow(25, 25, 0);
+
+  resetParticles(thisGreen);
 
   // Startup animation
-  for (int count = START_LED; count <= LED_COUNT; count++) {
-    strip.SetPixelColor(count, thisGreen);
-    delay(5);
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    strip.SetPixelColor(pixelIndex[pixel], thisGreen);
+    vTaskDelay(5 / portTICK_PERIOD_MS);
     strip.Show();
   }
 
+  // One pixel per frame, bouncing at the ends
+  spawnParticle(0, TO_PARTICLE_POSITION(1), thisYellow, PARTICLE_IMMORTAL, 25, PARTICLE_BOUNCE);
+
   while (true) {
-    if (count >= LED_COUNT) 
-      loopdirection = 1;
-    else if (count <= START_LED && loopdirection == 1)
-      loopdirection = 0;
-
-    strip.SetPixelColor(count, black);
-
-    if (loopdirection == 0) {
-       int brightness = 25;
-       int trailEnd = constrain(count - 25, START_LED, LED_COUNT);
-       
-       for(int i = count; i >= trailEnd; i--) {
-         strip.SetPixelColor(i, RgbColor (brightness, brightness, 0));
-         brightness--;
-       } 
-       
-       strip.SetPixelColor(trailEnd-1, thisGreen);
-       count++;
-     } else {
-       int brightness = 25;
-       int trailEnd = constrain(count + 25, START_LED, LED_COUNT);
-       
-       for(int i = count; i <= trailEnd; i++) {
-         strip.SetPixelColor(i, RgbColor (brightness, brightness, 0));
-         brightness--;
-       } 
-       
-       strip.SetPixelColor(trailEnd+1, thisGreen);
-       count--;
-     }
-      
-      strip.Show();
-      delay(25);
-    }
+    updateParticles();
+    drawParticles();
+    showParticles();
+
+    vTaskDelay(25 / portTICK_PERIOD_MS);
+  }
  }
 
  /**
@@ -441,9 +369,9 @@ void rainyDay(void * pvParameters) {
     
     // Spark the flame
     for (int spark = 0; spark <= 2; spark++) {
-      for (int count = START_LED; count <= LED_COUNT / 2; count+= 10) {
-        strip.SetPixelColor(count, white);
-        strip.SetPixelColor(LED_COUNT - count, white);
+      for (int count = 0; count < mapLength / 2; count+= 10) {
+        setPixelsAtPosition(count, white);
+        setPixelsAtPosition(mapLength - 1 - count, white);
         strip.Show();
       }
 
@@ -464,24 +392,24 @@ void rainyDay(void * pvParameters) {
       brightness = random(60, 75) / 100.0;
 
       // Pick a random red/orange color for each pixel
-      for (int count = START_LED; count <= LED_COUNT; count++) {
+      for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
         red = random(40, 75);
         green = random(20, 30);      
   
         color = RgbColor(red * brightness, green * brightness, 0);
         
-        strip.SetPixelColor(count, color);
+        strip.SetPixelColor(pixelIndex[pixel], color);
       }
 
       // Crackle
       if (crackleCounter >= nextCrackle) {
-        int crackleStart = random(START_LED, LED_COUNT - lineSize);
+        int crackleStart = random(0, mapLength - lineSize);
 
         // Show the crackle animation
         for (int count = crackleStart; count <= crackleStart + lineSize; count++) {
           int crackleRed = random(70, 95);
           int crackleYellow = random(25, 35);
-          strip.SetPixelColor(count, RgbColor(crackleRed, crackleYellow, 0));
+          setPixelsAtPosition(count, RgbColor(crackleRed, crackleYellow, 0));
         }
 
         // Reset counter and randomize next crackle time
@@ -504,73 +432,73 @@ void christmasFade(void * pvParameters) {
 
   const RgbColor snowWhite = RgbColor(30, 30, 30);
 
-  // Current pixel being changed
-  int pixelIndex = START_LED;
+  // Current position of the line heads
+  int position = 0;
 
   // Whether to set red or green first
   bool swapped = true;
   
-  // Index for middle pixel
-  int median = (LED_COUNT + START_LED) / 2;
+  // Middle position of the layout
+  int median = mapLength / 2;
   int lineSize = 36; 
 
   // Startup animation
   // Red Line Out
-  for (int count = START_LED; count <= median; count++) {
-    strip.SetPixelColor(count, red);
+  for (int count = 0; count < median; count++) {
+    setPixelsAtPosition(count, red);
     vTaskDelay(10 / portTICK_PERIOD_MS);
     strip.Show();
   }
 
   // Green Line Out
-  for (int count = median; count <= LED_COUNT; count++) {
-    strip.SetPixelColor(count, green);
+  for (int count = median; count < mapLength; count++) {
+    setPixelsAtPosition(count, green);
     vTaskDelay(10 / portTICK_PERIOD_MS);
     strip.Show();
   } 
 
   setAllPixels(black);
-  pixelIndex = START_LED;
 
   while (true) {
-    // Calculate the end of each line, constrain to within bounds of the strip
-    if (pixelIndex >= LED_COUNT) {
-      pixelIndex = START_LED;
+    if (position >= mapLength) {
+      position = 0;
       swapped = !swapped;
     }
 
-    int gLineEnd = constrain(pixelIndex - lineSize, START_LED, LED_COUNT);
-    int rLineEnd = constrain(LED_COUNT - pixelIndex + lineSize, START_LED, LED_COUNT);
+    // Lines leave a snow white or black trail, alternating each pass
+    RgbColor trailColor = swapped ? snowWhite : black;
 
     // Update pixels
-    strip.SetPixelColor(pixelIndex, green);
-    strip.SetPixelColor(LED_COUNT - pixelIndex, red);
-
-    if (swapped) {
-      strip.SetPixelColor(gLineEnd, snowWhite);
-      strip.SetPixelColor(rLineEnd, snowWhite);
-    } else {
-      strip.SetPixelColor(gLineEnd, black);
-      strip.SetPixelColor(rLineEnd, black);
-    }
+    setPixelsAtPosition(position, green);
+    setPixelsAtPosition(mapLength - 1 - position, red);
+    setPixelsAtPosition(position - lineSize, trailColor);
+    setPixelsAtPosition(mapLength - 1 - position + lineSize, trailColor);
     
     strip.Show();
-    pixelIndex++;
+    position++;
   }
 }
 
 /**
  * Music reactive EQ animation.
- * Uses audio data stream received from the microphone extension.
+ * Uses audio data stream received from the microphone extension,
+ * rendered as a spectrum at a fixed frame rate. See spectrum.h.
  */
 void audioEQ(void * pvParameters) {
   (void) pvParameters;
 
+  const TickType_t frameTicks = max((TickType_t) 1, (TickType_t) pdMS_TO_TICKS(1000 / SPECTRUM_FPS));
+  TickType_t lastFrame = xTaskGetTickCount();
+
+  initSpectrum();
+
   while (true) {
-    int bass = currentFFT.FFTBands[7];
-    int level = map(bass, 0, 12, 0, 200);
+    updateSpectrum();
+    drawSpectrum();
+    strip.Show();
 
-    setAllPixels(RgbColor(level, 0, 0));
+    // Wait out the rest of the frame
+    vTaskDelayUntil(&lastFrame, frameTicks);
   }
 }
 
@@ -38,5 +38,20 @@ animationTableEntry animationTable[] =
   { NULL }
 };
 
+/**
+ * Look up an animation by id. Returns NULL if there is no 
+ * animation with that id.
+ */
+animationTableEntry * findAnimation(int animationId) {
+  animationTableEntry *thisAnimationEntry = animationTable;
+
+  for ( ; thisAnimationEntry -> id != NULL ; thisAnimationEntry++ ) {
+    if (thisAnimationEntry -> id == animationId)
+      return thisAnimationEntry;
+  }
+
+  return NULL;
+}
+
 
 #endif
@@ -0,0 +1,154 @@
+#ifndef COMMANDPROTOCOL_H
+#define COMMANDPROTOCOL_H
+
+/**
+ * Compact binary command frames, accepted over the websocket
+ * (/api/stream) and the batch endpoint (POST /api/batch). A frame
+ * carries several commands which are validated together and only
+ * applied if all of them are valid.
+ *
+ * Frame layout:
+ *  byte 0     protocol version (COMMAND_PROTOCOL_VERSION)
+ *  bytes 1-2  sequence number, little endian, echoed in the ack
+ *  byte 3     number of commands (up to MAX_BATCH_COMMANDS)
+ *  then each command as an opcode byte followed by its operands:
+ *   CMD_POWER             state (POWER_STATE_OFF, POWER_STATE_ON or POWER_STATE_TOGGLE)
+ *   CMD_SELECT_ANIMATION  animation id
+ *   CMD_SET_COLOR         red, green, blue
+ *
+ * Acknowledgement layout:
+ *  byte 0     protocol version
+ *  bytes 1-2  sequence number of the acknowledged frame
+ *  byte 3     result (COMMAND_OK or an error code)
+ */
+
+#include "Arduino.h"
+
+#include "animations.h"
+
+#define COMMAND_PROTOCOL_VERSION 1
+#define COMMAND_HEADER_SIZE      4
+#define COMMAND_ACK_SIZE         4
+#define MAX_BATCH_COMMANDS       16
+
+// Command opcodes
+#define CMD_POWER            0x01
+#define CMD_SELECT_ANIMATION 0x02
+#define CMD_SET_COLOR        0x03
+
+// CMD_POWER states
+#define POWER_STATE_OFF    0
+#define POWER_STATE_ON     1
+#define POWER_STATE_TOGGLE 2
+
+// Result codes sent in the acknowledgement
+#define COMMAND_OK               0
+#define COMMAND_BAD_VERSION      1 // unsupported protocol version
+#define COMMAND_MALFORMED        2 // truncated frame or trailing bytes
+#define COMMAND_UNKNOWN_OPCODE   3 // opcode not recognised
+#define COMMAND_INVALID_ARGUMENT 4 // operand out of range
+#define COMMAND_TOO_LARGE        5 // too many commands, or frame split across packets
+#define COMMAND_BUSY             6 // command queue full, frame not applied
+
+// A single decoded command
+typedef struct command {
+  uint8_t opcode;      // one of the CMD_ opcodes
+  uint8_t operands[3]; // operands, unused bytes are zero
+} command;
+
+// A decoded frame
+typedef struct commandBatch {
+  uint16_t sequence; // sequence number from the frame header
+  uint8_t count;     // number of valid entries in commands
+  command commands[MAX_BATCH_COMMANDS];
+} commandBatch;
+
+/**
+ * Number of operand bytes following an opcode, or -1 if the
+ * opcode is unknown
+ */
+int commandOperandCount(uint8_t opcode) {
+  switch (opcode) {
+    case CMD_POWER:            return 1;
+    case CMD_SELECT_ANIMATION: return 1;
+    case CMD_SET_COLOR:        return 3;
+    default:                   return -1;
+  }
+}
+
+/**
+ * Check a decoded command's operands
+ */
+bool isValidCommand(const command &cmd) {
+  switch (cmd.opcode) {
+    case CMD_POWER:            return cmd.operands[0] <= POWER_STATE_TOGGLE;
+    case CMD_SELECT_ANIMATION: return findAnimation(cmd.operands[0]) != NULL;
+    default:                   return true;
+  }
+}
+
+/**
+ * Decode and validate a frame into batch. Returns COMMAND_OK only
+ * if every command in the frame is valid.
+ */
+uint8_t decodeCommandBatch(const uint8_t *data, size_t len, commandBatch &batch) {
+  batch.sequence = 0;
+  batch.count = 0;
+
+  if (len < COMMAND_HEADER_SIZE)
+    return COMMAND_MALFORMED;
+
+  batch.sequence = data[1] | (data[2] << 8);
+
+  if (data[0] != COMMAND_PROTOCOL_VERSION)
+    return COMMAND_BAD_VERSION;
+
+  uint8_t count = data[3];
+
+  if (count > MAX_BATCH_COMMANDS)
+    return COMMAND_TOO_LARGE;
+
+  size_t offset = COMMAND_HEADER_SIZE;
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (offset >= len)
+      return COMMAND_MALFORMED;
+
+    command &cmd = batch.commands[i];
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = data[offset++];
+
+    int operandCount = commandOperandCount(cmd.opcode);
+
+    if (operandCount < 0)
+      return COMMAND_UNKNOWN_OPCODE;
+
+    if (offset + operandCount > len)
+      return COMMAND_MALFORMED;
+
+    memcpy(cmd.operands, &data[offset], operandCount);
+    offset += operandCount;
+
+    if (!isValidCommand(cmd))
+      return COMMAND_INVALID_ARGUMENT;
+  }
+
+  if (offset != len)
+    return COMMAND_MALFORMED;
+
+  batch.count = count;
+  return COMMAND_OK;
+}
+
+/**
+ * Write the acknowledgement for a frame into ack, which must hold
+ * COMMAND_ACK_SIZE bytes
+ */
+void encodeCommandAck(uint16_t sequence, uint8_t result, uint8_t *ack) {
+  ack[0] = COMMAND_PROTOCOL_VERSION;
+  ack[1] = sequence & 0xFF;
+  ack[2] = sequence >> 8;
+  ack[3] = result;
+}
+
+#endif
@@ -14,12 +14,12 @@
 
 // WiFi settings
 const char * HOSTNAME = "LEDStrip"; // Network device name
-const uint8_t CONNECT_TIMEOUT = 5;  // Timeout for connection (seconds)
-bool BLOCK_UNTIL_CONNECTED = true;  // Whether to block execution until connected
+const uint8_t CONNECT_TIMEOUT = 5;  // Time to wait for the saved network before opening the config portal (seconds)
 bool USE_MDNS = true;               // Whether to start mDNS responder
 
 // Web server settings
-bool CORS_ENABLED = true; // True value adds the Access-Control-Allow-Origin header
+bool CORS_ENABLED = true;               // True value adds the Access-Control-Allow-Origin header
+const uint8_t COMMAND_QUEUE_LENGTH = 8; // Commands that can wait for the control task before requests are refused
 
 // NeoPixel strip settings
 const uint8_t LED_PIN    = 4;   // GPIO pin connected to LED data
@@ -27,6 +27,30 @@ const uint8_t LED_COUNT  = 246; // Number of LEDs in the strip
 const uint8_t START_LED  = 1;   // Index of the first pixel (offset by one if using internal status LED)
 const uint8_t SATURATION = 128; // Maximum brightness
 
+// Physical layout settings (see pixelMap.h for the available layouts)
+#define PIXEL_LAYOUT LAYOUT_LINEAR
+const uint8_t MATRIX_WIDTH   = 16;             // Pixels per row for LAYOUT_MATRIX
+const uint8_t RUN_LENGTHS[]  = { 82, 82, 81 }; // Pixels in each run for LAYOUT_RUNS
+const bool    RUNS_ALTERNATE = false;          // Whether every other run is wired in reverse
+
+// Power supply settings. Frames estimated to draw more than the budget are dimmed to fit.
+const uint32_t POWER_BUDGET_MA   = 6000; // Current available to the strip (mA), 0 to disable limiting
+const uint8_t  MA_PER_CHANNEL    = 20;   // Current drawn by one color channel at full brightness (mA)
+const uint8_t  MA_PER_PIXEL_IDLE = 1;    // Current drawn by each pixel when off (mA)
+
+// Audio spectrum settings (Audio EQ animation)
+const uint8_t  SPECTRUM_FPS         = 60;    // Render frame rate
+const bool     SPECTRUM_FROM_CENTRE = true;  // Bands grow out from the centre of the layout rather than along it
+const uint8_t  SPECTRUM_MAX_LEVEL   = 12;    // Band value that fills a band's segment
+const float    SPECTRUM_ATTACK      = 0.6;   // Fraction of a rise applied each frame (0 - 1)
+const float    SPECTRUM_RELEASE     = 0.1;   // Fraction of a fall applied each frame (0 - 1)
+const uint16_t SPECTRUM_PEAK_HOLD   = 400;   // Time a peak marker holds before falling (ms)
+const float    SPECTRUM_PEAK_DECAY  = 0.01;  // Fraction of a segment a peak marker falls each frame
+const uint16_t SPECTRUM_TIMEOUT     = 1000;  // Time without updates before the spectrum falls silent (ms)
+
+// Particle effect settings (Rainy Day, Mello Yello)
+const uint16_t PARTICLE_CAPACITY = 128; // Particles that can be alive at once
+
 // Network settings
 #define SERVER_PORT 80  // Port for web application
 
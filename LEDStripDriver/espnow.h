@@ -4,15 +4,230 @@
 /**
  * Data structures and methods to handle ESPNow communication
  * between the controller and extension devices.
+ *
+ * Every message starts with a messageHeader followed by a payload
+ * of the type given in the header. Received messages are checked
+ * against messageHandlerTable and handed to the matching handler as
+ * a pointer into the received packet, without copying.
+ *
+ * Extensions announce themselves by broadcasting MSG_HELLO. The
+ * controller registers the sender as a peer and answers with
+ * MSG_HELLO_ACK, after which the extension sends to the controller
+ * directly. No MAC addresses need to be configured on either side.
+ * Extensions keep saying hello at a slower rate once paired, so the
+ * controller registers them again after a restart.
+ *
+ * To add a new extension message, define its payload struct and
+ * add an entry to messageHandlerTable.
  */
 
 #include "Arduino.h"
 
-// Wrapper for a single message received from the controller
-typedef struct message {
-  int FFTBands[8]; // Frequency band values (0 - 12)
-} message;
+#include <esp_now.h>
 
-message currentFFT;
+#define ESPNOW_PROTOCOL_VERSION 1
+#define ESPNOW_MAX_PEERS        6
+
+// Message types
+#define MSG_HELLO       0x01 // extension announcing itself
+#define MSG_HELLO_ACK   0x02 // controller accepting an extension
+#define MSG_AUDIO_BANDS 0x10 // audio spectrum from the audio extension
+
+// Extension types, sent in MSG_HELLO
+#define EXTENSION_AUDIO 0x01
+
+// Header at the start of every message
+typedef struct __attribute__((packed)) messageHeader {
+  uint8_t version;  // ESPNOW_PROTOCOL_VERSION
+  uint8_t type;     // one of the MSG_ types
+  uint8_t length;   // payload length in bytes, excluding the header
+  uint8_t sequence; // incremented by the sender for every message
+} messageHeader;
+
+// MSG_HELLO and MSG_HELLO_ACK payload
+typedef struct __attribute__((packed)) helloMessage {
+  uint8_t extensionType; // one of the EXTENSION_ types
+} helloMessage;
+
+// MSG_AUDIO_BANDS payload
+typedef struct __attribute__((packed)) audioBandsMessage {
+  uint8_t bands[8]; // Frequency band values (0 - 12), lowest band first
+} audioBandsMessage;
+
+// A registered extension device
+typedef struct extensionPeer {
+  uint8_t address[6];    // MAC address
+  uint8_t extensionType; // one of the EXTENSION_ types
+  uint8_t lastSequence;  // sequence number of the last accepted message
+  unsigned long lastSeen; // millis() when the last message arrived
+} extensionPeer;
+
+// Registered extensions
+extensionPeer peers[ESPNOW_MAX_PEERS];
+uint8_t peerCount = 0;
+
+// Latest and previous audio spectrum received from the audio extension
+audioBandsMessage currentAudioBands;
+audioBandsMessage previousAudioBands;
+
+// millis() when currentAudioBands arrived, and the average time
+// between updates. Used to interpolate between updates.
+unsigned long audioBandsReceived = 0;
+unsigned long audioBandsInterval = 20;
+
+// Guards the audio spectrum, which is written from the WiFi task
+portMUX_TYPE audioBandsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Sequence number for messages sent by the controller
+uint8_t sendSequence = 0;
+
+/**
+ * Find a registered peer by MAC address. Returns NULL if the
+ * sender has not said hello.
+ */
+extensionPeer * findPeer(const uint8_t *address) {
+  for (uint8_t i = 0; i < peerCount; i++) {
+    if (memcmp(peers[i].address, address, 6) == 0)
+      return &peers[i];
+  }
+
+  return NULL;
+}
+
+/**
+ * Send a message with the given payload to a peer
+ */
+esp_err_t sendMessage(const uint8_t *address, uint8_t type, const void *payload, uint8_t length) {
+  uint8_t packet[sizeof(messageHeader) + ESP_NOW_MAX_DATA_LEN];
+  messageHeader *header = (messageHeader *) packet;
+
+  if (sizeof(messageHeader) + length > ESP_NOW_MAX_DATA_LEN)
+    return ESP_ERR_INVALID_SIZE;
+
+  header -> version = ESPNOW_PROTOCOL_VERSION;
+  header -> type = type;
+  header -> length = length;
+  header -> sequence = sendSequence++;
+
+  memcpy(packet + sizeof(messageHeader), payload, length);
+
+  return esp_now_send(address, packet, sizeof(messageHeader) + length);
+}
+
+/**
+ * Register the sender of a hello message and acknowledge it
+ */
+void handleHello(extensionPeer *peer, const uint8_t *address, const void *payload) {
+  const helloMessage *hello = (const helloMessage *) payload;
+
+  if (peer == NULL) {
+    if (peerCount >= ESPNOW_MAX_PEERS) {
+      Serial.println("ESPNow peer list full");
+      return;
+    }
+
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, address, 6);
+    peerInfo.channel = 0;
+    peerInfo.encrypt = false;
+
+    esp_err_t addStatus = esp_now_add_peer(&peerInfo);
+
+    if (addStatus != ESP_OK && addStatus != ESP_ERR_ESPNOW_EXIST) {
+      Serial.println("ESPNow pairing failed");
+      return;
+    }
+
+    peer = &peers[peerCount++];
+    memcpy(peer -> address, address, 6);
+
+    Serial.print("ESPNow extension paired, type ");
+    Serial.println(hello -> extensionType);
+  }
+
+  peer -> extensionType = hello -> extensionType;
+
+  sendMessage(address, MSG_HELLO_ACK, hello, sizeof(helloMessage));
+}
+
+/**
+ * Store the latest audio spectrum
+ */
+void handleAudioBands(extensionPeer *peer, const uint8_t *address, const void *payload) {
+  unsigned long now = millis();
+
+  // Ignore long gaps so one pause doesn't stretch the interval
+  unsigned long interval = min(now - audioBandsReceived, 200UL);
+
+  portENTER_CRITICAL(&audioBandsMux);
+  previousAudioBands = currentAudioBands;
+  memcpy(&currentAudioBands, payload, sizeof(audioBandsMessage));
+  audioBandsInterval = max((audioBandsInterval * 3 + interval) / 4, 1UL);
+  audioBandsReceived = now;
+  portEXIT_CRITICAL(&audioBandsMux);
+}
+
+// Message handler table lookup entry
+typedef struct messageHandlerEntry {
+  uint8_t type;       // message type
+  uint8_t length;     // expected payload length
+  bool requiresPeer;  // whether the sender must have said hello first
+  void (*handler)(extensionPeer *, const uint8_t *, const void *); // handler function
+} messageHandlerEntry;
+
+// Message handler table. Add new extension messages here.
+messageHandlerEntry messageHandlerTable[] =
+{
+  { MSG_HELLO,       sizeof(helloMessage),      false, &handleHello      },
+  { MSG_AUDIO_BANDS, sizeof(audioBandsMessage), true,  &handleAudioBands },
+  { 0 }
+};
+
+/**
+ * Validate a received packet and pass its payload to the
+ * registered handler. Malformed packets, unknown types and
+ * messages from unregistered senders are dropped.
+ */
+void dispatchMessage(const uint8_t *address, const uint8_t *data, int length) {
+  if (length < (int) sizeof(messageHeader))
+    return;
+
+  const messageHeader *header = (const messageHeader *) data;
+
+  if (header -> version != ESPNOW_PROTOCOL_VERSION)
+    return;
+
+  if (header -> length != length - sizeof(messageHeader))
+    return;
+
+  struct messageHandlerEntry *thisHandlerEntry = messageHandlerTable;
+
+  for ( ; thisHandlerEntry -> handler != NULL ; thisHandlerEntry++ ) {
+    if (thisHandlerEntry -> type != header -> type)
+      continue;
+
+    if (thisHandlerEntry -> length != header -> length)
+      return;
+
+    extensionPeer *peer = findPeer(address);
+
+    if (thisHandlerEntry -> requiresPeer) {
+      if (peer == NULL)
+        return;
+
+      // Drop stale or repeated messages
+      if ((int8_t) (header -> sequence - peer -> lastSequence) <= 0 && peer -> lastSeen != 0)
+        return;
+    }
+
+    if (peer != NULL) {
+      peer -> lastSequence = header -> sequence;
+      peer -> lastSeen = millis();
+    }
+
+    thisHandlerEntry -> handler(peer, address, data + sizeof(messageHeader));
+    return;
+  }
+}
 
 #endif
@@ -0,0 +1,131 @@
+#ifndef _JSONWRITER_H
+#define _JSONWRITER_H
+
+/**
+ * Minimal streaming JSON writer. Output is written straight to any
+ * Print (e.g. an AsyncResponseStream) as it is produced, so building a
+ * response never concatenates Strings on the heap.
+ *
+ * Example:
+ *  JsonWriter json(*response);
+ *  json.beginObject();
+ *    json.beginObject("status");
+ *      json.add("powerOn", 1);
+ *    json.endObject();
+ *  json.endObject();
+ */
+
+#include "Arduino.h"
+
+class JsonWriter {
+  public:
+    JsonWriter(Print &output) : output(output), depth(0), hasMembers(0) {}
+
+    // Open an object, optionally as a named member of the enclosing object
+    void beginObject(const char * key = NULL) {
+      open(key, '{');
+    }
+
+    void endObject() {
+      close('}');
+    }
+
+    // Open an array, optionally as a named member of the enclosing object
+    void beginArray(const char * key = NULL) {
+      open(key, '[');
+    }
+
+    void endArray() {
+      close(']');
+    }
+
+    // Add a value. Pass a NULL key when adding array elements, and a
+    // NULL string value to write null.
+    void add(const char * key, const char * value) {
+      writeKey(key);
+
+      if (value == NULL)
+        output.print("null");
+      else
+        writeString(value);
+    }
+
+    void add(const char * key, bool value) {
+      writeKey(key);
+      output.print(value ? "true" : "false");
+    }
+
+    void add(const char * key, int value) {
+      writeKey(key);
+      output.print(value);
+    }
+
+    void add(const char * key, unsigned int value) {
+      writeKey(key);
+      output.print(value);
+    }
+
+    void add(const char * key, unsigned long value) {
+      writeKey(key);
+      output.print(value);
+    }
+
+  private:
+    Print &output;
+    uint8_t depth;       // current nesting depth
+    uint32_t hasMembers; // one bit per depth, set once a member is written
+
+    void open(const char * key, char bracket) {
+      writeKey(key);
+      output.write(bracket);
+
+      depth++;
+      hasMembers &= ~(1UL << depth);
+    }
+
+    void close(char bracket) {
+      output.write(bracket);
+      depth--;
+    }
+
+    // Write the separator and, inside objects, the quoted key
+    void writeKey(const char * key) {
+      if (hasMembers & (1UL << depth))
+        output.write(',');
+
+      hasMembers |= (1UL << depth);
+
+      if (key != NULL) {
+        writeString(key);
+        output.write(':');
+      }
+    }
+
+    // Write a quoted, escaped string
+    void writeString(const char * value) {
+      output.write('"');
+
+      for ( ; *value != '\0' ; value++) {
+        char c = *value;
+
+        switch (c) {
+          case '"':  output.print("\\\""); break;
+          case '\\': output.print("\\\\"); break;
+          case '\n': output.print("\\n");  break;
+          case '\r': output.print("\\r");  break;
+          case '\t': output.print("\\t");  break;
+          default:
+            if ((uint8_t) c < 0x20) {
+              // Remaining control characters as \u00XX
+              output.printf("\\u%04x", c);
+            } else {
+              output.write(c);
+            }
+        }
+      }
+
+      output.write('"');
+    }
+};
+
+#endif
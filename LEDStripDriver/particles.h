@@ -0,0 +1,219 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+/**
+ * Fixed-capacity particle engine for rain, sparkle and comet effects.
+ *
+ * Particles are stored as a structure of arrays in a single
+ * statically allocated pool. Live particles are packed at the front
+ * of the arrays, so updates only touch live particles and removing
+ * one is a swap with the last. Each frame only the pixels a particle
+ * covered last frame are restored to the background, and only the
+ * pixels it covers now are drawn, so the cost of a frame depends on
+ * the number of live particles rather than the length of the strip.
+ * Frames in which no particle touched a pixel are not shown.
+ *
+ * Positions are logical pixels (see pixelMap.h) in 8.8 fixed point.
+ *
+ * Typical frame:
+ *  spawnParticle(...);   // as needed
+ *  updateParticles();
+ *  drawParticles();
+ *  showParticles();
+ */
+
+#include "Arduino.h"
+
+#include "animationFunctionHelpers.h"
+#include "config.h"
+
+// Particle behaviour flags
+#define PARTICLE_FADE   0x01 // blend into the background over its lifetime
+#define PARTICLE_BOUNCE 0x02 // reverse at the ends of the strip instead of dying
+
+// Lifetime value for particles that never expire
+#define PARTICLE_IMMORTAL 0
+
+// Convert whole pixels to and from 8.8 fixed point
+#define TO_PARTICLE_POSITION(pixel) ((int32_t) (pixel) << 8)
+#define FROM_PARTICLE_POSITION(position) ((position) >> 8)
+
+/**
+ * Pool of particles, one array per property
+ */
+struct particleSystem {
+  uint16_t count;                         // live particles, packed at the front
+  RgbColor background;                    // color restored behind particles
+
+  int32_t  position[PARTICLE_CAPACITY];   // head position, 8.8 fixed point pixels
+  int16_t  velocity[PARTICLE_CAPACITY];   // 8.8 fixed point pixels per frame
+  RgbColor color[PARTICLE_CAPACITY];      // head color
+  uint16_t life[PARTICLE_CAPACITY];       // frames left to live
+  uint16_t lifetime[PARTICLE_CAPACITY];   // frames to live when spawned
+  uint8_t  trail[PARTICLE_CAPACITY];      // trail length in pixels
+  uint8_t  flags[PARTICLE_CAPACITY];      // PARTICLE_ flags
+  int16_t  drawnHead[PARTICLE_CAPACITY];  // head pixel drawn last frame, -1 if none
+  int8_t   drawnDirection[PARTICLE_CAPACITY]; // direction of the trail drawn last frame
+
+  bool dirty; // whether a particle pixel changed since the last show
+};
+
+particleSystem particles;
+
+/**
+ * Remove every particle and set the background color
+ */
+void resetParticles(RgbColor background) {
+  particles.count = 0;
+  particles.background = background;
+  particles.dirty = false;
+}
+
+/**
+ * Add a particle. Returns its index, or -1 if the pool is full.
+ */
+int spawnParticle(
+  uint16_t pixel,
+  int16_t velocity,
+  RgbColor color,
+  uint16_t lifetime,
+  uint8_t trail,
+  uint8_t flags
+){
+  if (particles.count >= PARTICLE_CAPACITY || pixel >= MAPPED_PIXEL_COUNT)
+    return -1;
+
+  uint16_t i = particles.count++;
+
+  particles.position[i] = TO_PARTICLE_POSITION(pixel);
+  particles.velocity[i] = velocity;
+  particles.color[i] = color;
+  particles.life[i] = lifetime;
+  particles.lifetime[i] = lifetime;
+  particles.trail[i] = trail;
+  particles.flags[i] = flags;
+  particles.drawnHead[i] = -1;
+  particles.drawnDirection[i] = 0;
+
+  return i;
+}
+
+/**
+ * Set a logical pixel and note that the strip needs showing
+ */
+void setParticlePixel(int16_t pixel, RgbColor color) {
+  if (pixel < 0 || pixel >= MAPPED_PIXEL_COUNT)
+    return;
+
+  strip.SetPixelColor(pixelIndex[pixel], color);
+
+  particles.dirty = true;
+}
+
+/**
+ * Restore the pixels a particle covered last frame to the background
+ */
+void eraseParticle(uint16_t i) {
+  int16_t head = particles.drawnHead[i];
+
+  if (head < 0)
+    return;
+
+  for (int16_t k = 0; k <= particles.trail[i]; k++) {
+    setParticlePixel(head - k * particles.drawnDirection[i], particles.background);
+  }
+
+  particles.drawnHead[i] = -1;
+}
+
+/**
+ * Remove a particle by moving the last live particle into its slot
+ */
+void removeParticle(uint16_t i) {
+  uint16_t last = --particles.count;
+
+  if (i == last)
+    return;
+
+  particles.position[i] = particles.position[last];
+  particles.velocity[i] = particles.velocity[last];
+  particles.color[i] = particles.color[last];
+  particles.life[i] = particles.life[last];
+  particles.lifetime[i] = particles.lifetime[last];
+  particles.trail[i] = particles.trail[last];
+  particles.flags[i] = particles.flags[last];
+  particles.drawnHead[i] = particles.drawnHead[last];
+  particles.drawnDirection[i] = particles.drawnDirection[last];
+}
+
+/**
+ * Erase, age and move every live particle by one frame. Particles
+ * that expire or leave the strip are removed.
+ */
+void updateParticles() {
+  const int32_t lastPosition = TO_PARTICLE_POSITION(MAPPED_PIXEL_COUNT - 1);
+  uint16_t i = 0;
+
+  while (i < particles.count) {
+    eraseParticle(i);
+
+    // Age
+    if (particles.lifetime[i] != PARTICLE_IMMORTAL && --particles.life[i] == 0) {
+      removeParticle(i);
+      continue;
+    }
+
+    // Move
+    particles.position[i] += particles.velocity[i];
+
+    if (particles.position[i] < 0 || particles.position[i] > lastPosition) {
+      if (! (particles.flags[i] & PARTICLE_BOUNCE)) {
+        removeParticle(i);
+        continue;
+      }
+
+      particles.position[i] = constrain(particles.position[i], 0, lastPosition);
+      particles.velocity[i] = -particles.velocity[i];
+    }
+
+    i++;
+  }
+}
+
+/**
+ * Draw every live particle, with its trail fading into the background
+ */
+void drawParticles() {
+  for (uint16_t i = 0; i < particles.count; i++) {
+    int16_t head = FROM_PARTICLE_POSITION(particles.position[i]);
+    int8_t direction = (particles.velocity[i] > 0) - (particles.velocity[i] < 0);
+    uint8_t trail = direction == 0 ? 0 : particles.trail[i];
+    RgbColor color = particles.color[i];
+
+    if ((particles.flags[i] & PARTICLE_FADE) && particles.lifetime[i] != PARTICLE_IMMORTAL) {
+      float remaining = (float) particles.life[i] / particles.lifetime[i];
+      color = RgbColor::LinearBlend(particles.background, color, remaining);
+    }
+
+    for (int16_t k = 0; k <= trail; k++) {
+      float progress = (float) k / (trail + 1);
+      setParticlePixel(head - k * direction, RgbColor::LinearBlend(color, particles.background, progress));
+    }
+
+    particles.drawnHead[i] = head;
+    particles.drawnDirection[i] = direction;
+  }
+}
+
+/**
+ * Show the strip if any particle pixels changed since the last show
+ */
+void showParticles() {
+  if (! particles.dirty)
+    return;
+
+  strip.Show();
+  particles.dirty = false;
+}
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef PIXELMAP_H
+#define PIXELMAP_H
+
+/**
+ * Lookup tables describing the physical layout of the strip.
+ *
+ * Animations address pixels by their logical index (0 to
+ * MAPPED_PIXEL_COUNT - 1) rather than doing index arithmetic on
+ * START_LED and LED_COUNT. For every logical pixel the tables hold:
+ *  - pixelIndex:    physical index on the strip
+ *  - pixelPosition: 1-D position along the layout (0 to mapLength - 1)
+ *  - pixelX/pixelY: 2-D coordinates
+ *  - pixelDistance: distance from the centre of the layout
+ *
+ * The inverse table lists logical pixels sorted by position. The
+ * pixels at position p are positionPixels[positionStart[p]] up to,
+ * but not including, positionPixels[positionStart[p + 1]].
+ *
+ * Set PIXEL_LAYOUT in config.h to one of the layouts below. The tables
+ * are built once by initPixelMap().
+ */
+
+#include "Arduino.h"
+
+#include "config.h"
+
+// Supported physical layouts
+#define LAYOUT_LINEAR   0 // one straight run
+#define LAYOUT_MIRRORED 1 // folded in the middle, both halves show the same position
+#define LAYOUT_RING     2 // closed loop
+#define LAYOUT_MATRIX   3 // zig-zag matrix, MATRIX_WIDTH pixels per row
+#define LAYOUT_RUNS     4 // several straight runs of RUN_LENGTHS pixels, each with its own centre
+
+// Number of pixels available to animations (excludes the status LED)
+const uint16_t MAPPED_PIXEL_COUNT = LED_COUNT - START_LED;
+
+// Number of runs for LAYOUT_RUNS
+const uint16_t RUN_COUNT = sizeof(RUN_LENGTHS) / sizeof(RUN_LENGTHS[0]);
+
+// Per-pixel lookup tables, indexed by logical pixel
+uint16_t pixelIndex[MAPPED_PIXEL_COUNT];
+uint16_t pixelPosition[MAPPED_PIXEL_COUNT];
+int16_t  pixelX[MAPPED_PIXEL_COUNT];
+int16_t  pixelY[MAPPED_PIXEL_COUNT];
+uint16_t pixelDistance[MAPPED_PIXEL_COUNT];
+
+// Upper bound on the number of positions (a matrix may have a 
+// partly filled last row)
+const uint16_t MAX_MAP_LENGTH = MAPPED_PIXEL_COUNT + MATRIX_WIDTH;
+
+// Inverse lookup table, from position to logical pixels
+uint16_t positionPixels[MAPPED_PIXEL_COUNT];
+uint16_t positionStart[MAX_MAP_LENGTH + 1];
+
+// Number of distinct positions along the layout
+uint16_t mapLength = MAPPED_PIXEL_COUNT;
+
+// Largest value in pixelDistance
+uint16_t maxPixelDistance = 0;
+
+/**
+ * Distance of a coordinate from the centre of a span of the given
+ * length, in whole pixels
+ */
+uint16_t distanceFromCentre(int16_t coordinate, uint16_t length) {
+  return abs(2 * coordinate - (length - 1)) / 2;
+}
+
+/**
+ * Build the lookup tables for the configured layout
+ */
+void initPixelMap() {
+  uint16_t rows = 1;
+  uint16_t run = 0;
+  uint16_t runStart = 0;
+
+  if (PIXEL_LAYOUT == LAYOUT_MIRRORED)
+    mapLength = (MAPPED_PIXEL_COUNT + 1) / 2;
+
+  if (PIXEL_LAYOUT == LAYOUT_MATRIX) {
+    rows = (MAPPED_PIXEL_COUNT + MATRIX_WIDTH - 1) / MATRIX_WIDTH;
+    mapLength = MATRIX_WIDTH * rows;
+  }
+
+  if (PIXEL_LAYOUT == LAYOUT_RUNS) {
+    mapLength = 0;
+
+    for (uint16_t r = 0; r < RUN_COUNT; r++)
+      mapLength = max(mapLength, (uint16_t) RUN_LENGTHS[r]);
+  }
+
+  for (uint16_t i = 0; i < MAPPED_PIXEL_COUNT; i++) {
+    pixelIndex[i] = START_LED + i;
+
+    switch (PIXEL_LAYOUT) {
+      case LAYOUT_MIRRORED:
+        pixelPosition[i] = (i < mapLength) ? i : MAPPED_PIXEL_COUNT - 1 - i;
+        pixelX[i] = pixelPosition[i];
+        pixelY[i] = 0;
+        pixelDistance[i] = distanceFromCentre(pixelX[i], mapLength);
+        break;
+
+      case LAYOUT_RING: {
+        // Place pixels on a circle with one pixel of spacing
+        float angle = 2 * PI * i / MAPPED_PIXEL_COUNT;
+        float radius = MAPPED_PIXEL_COUNT / (2 * PI);
+
+        pixelPosition[i] = i;
+        pixelX[i] = round(radius * cos(angle));
+        pixelY[i] = round(radius * sin(angle));
+        pixelDistance[i] = distanceFromCentre(i, MAPPED_PIXEL_COUNT);
+        break;
+      }
+
+      case LAYOUT_MATRIX: {
+        // Every other row runs backwards
+        uint16_t row = i / MATRIX_WIDTH;
+        uint16_t column = i % MATRIX_WIDTH;
+
+        if (row % 2 == 1)
+          column = MATRIX_WIDTH - 1 - column;
+
+        int16_t dx = 2 * column - (MATRIX_WIDTH - 1);
+        int16_t dy = 2 * row - (rows - 1);
+
+        pixelPosition[i] = row * MATRIX_WIDTH + column;
+        pixelX[i] = column;
+        pixelY[i] = row;
+        pixelDistance[i] = sqrt(dx * dx + dy * dy) / 2;
+        break;
+      }
+
+      case LAYOUT_RUNS: {
+        // Move to the next run once this one is full. Extra pixels
+        // are added to the last run.
+        if (run + 1 < RUN_COUNT && i - runStart >= RUN_LENGTHS[run]) {
+          runStart += RUN_LENGTHS[run];
+          run++;
+        }
+
+        uint16_t runLength = (run + 1 < RUN_COUNT) ?
+          RUN_LENGTHS[run] : MAPPED_PIXEL_COUNT - runStart;
+        uint16_t offset = i - runStart;
+
+        if (RUNS_ALTERNATE && run % 2 == 1)
+          offset = runLength - 1 - offset;
+
+        pixelPosition[i] = min(offset, (uint16_t) (mapLength - 1));
+        pixelX[i] = offset;
+        pixelY[i] = run;
+        pixelDistance[i] = distanceFromCentre(offset, runLength);
+        break;
+      }
+
+      default: // LAYOUT_LINEAR
+        pixelPosition[i] = i;
+        pixelX[i] = i;
+        pixelY[i] = 0;
+        pixelDistance[i] = distanceFromCentre(i, MAPPED_PIXEL_COUNT);
+    }
+
+    maxPixelDistance = max(maxPixelDistance, pixelDistance[i]);
+  }
+
+  // Sort pixels by position. Count the pixels at each position, 
+  // turn the counts into start offsets, then place each pixel.
+  memset(positionStart, 0, sizeof(positionStart));
+
+  for (uint16_t i = 0; i < MAPPED_PIXEL_COUNT; i++)
+    positionStart[pixelPosition[i] + 1]++;
+
+  for (uint16_t p = 0; p < mapLength; p++)
+    positionStart[p + 1] += positionStart[p];
+
+  uint16_t nextSlot[MAX_MAP_LENGTH];
+  memcpy(nextSlot, positionStart, sizeof(nextSlot));
+
+  for (uint16_t i = 0; i < MAPPED_PIXEL_COUNT; i++)
+    positionPixels[nextSlot[pixelPosition[i]]++] = i;
+}
+
+#endif
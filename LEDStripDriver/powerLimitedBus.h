@@ -0,0 +1,162 @@
+#ifndef POWERLIMITEDBUS_H
+#define POWERLIMITEDBUS_H
+
+/**
+ * NeoPixelBus wrapper that keeps each frame within the power
+ * supply's current budget.
+ *
+ * A running sum of all channel values is kept up to date by
+ * SetPixelColor(), so estimating a frame's current on Show() is a
+ * single multiply. Frames over POWER_BUDGET_MA are scaled down with
+ * one fixed-point pass before being sent, and the unscaled colors are
+ * restored afterwards so animations never see the dimmed values.
+ *
+ * The running sum is only correct while one task owns the strip.
+ * Call RecomputeChannelSum() when ownership changes, e.g. after an
+ * animation task is deleted part way through a frame.
+ *
+ * The status LED can be set from any task with SetStatusColor(). It
+ * is drawn by whichever task shows the next frame, so other tasks
+ * never write to the strip while an animation is running.
+ */
+
+#include "Arduino.h"
+
+#include <NeoPixelBus.h>
+#include <atomic>
+
+#include "config.h"
+
+/**
+ * Counters describing how often frames had to be limited
+ */
+struct powerMetrics {
+  uint32_t framesShown;     // frames sent to the strip
+  uint32_t framesLimited;   // frames scaled down to fit the budget
+  uint32_t lastEstimateMa;  // estimated current of the last frame, before limiting (mA)
+};
+
+template<typename T_COLOR_FEATURE, typename T_METHOD>
+class PowerLimitedBus : public NeoPixelBus<T_COLOR_FEATURE, T_METHOD> {
+  typedef NeoPixelBus<T_COLOR_FEATURE, T_METHOD> Bus;
+  typedef typename T_COLOR_FEATURE::ColorObject ColorObject;
+
+  public:
+    PowerLimitedBus(uint16_t countPixels, uint8_t pin) :
+      Bus(countPixels, pin),
+      channelSum(0),
+      statusPixel(0),
+      statusColor(0),
+      metrics() {
+      // Allocated once, used to restore colors after a limited frame
+      unlimitedPixels = new uint8_t[Bus::PixelsSize()];
+    }
+
+    ~PowerLimitedBus() {
+      delete[] unlimitedPixels;
+    }
+
+    void SetPixelColor(uint16_t indexPixel, ColorObject color) {
+      if (indexPixel >= Bus::PixelCount())
+        return;
+
+      // Keep the channel sum current
+      channelSum -= channelTotal(Bus::GetPixelColor(indexPixel));
+      channelSum += channelTotal(color);
+
+      Bus::SetPixelColor(indexPixel, color);
+    }
+
+    void Show() {
+      drawStatusColor();
+
+      if (!Bus::IsDirty())
+        return;
+
+      uint32_t idleMa = (uint32_t) MA_PER_PIXEL_IDLE * Bus::PixelCount();
+      uint32_t activeMa = channelSum * MA_PER_CHANNEL / 255;
+
+      metrics.framesShown++;
+      metrics.lastEstimateMa = idleMa + activeMa;
+
+      if (POWER_BUDGET_MA == 0 || activeMa == 0 || metrics.lastEstimateMa <= POWER_BUDGET_MA) {
+        Bus::Show();
+        return;
+      }
+
+      // Over budget. Scale every channel by the same Q8 factor.
+      uint32_t availableMa = POWER_BUDGET_MA > idleMa ? POWER_BUDGET_MA - idleMa : 0;
+      uint16_t scale = (availableMa << 8) / activeMa;
+
+      uint8_t * pixels = Bus::Pixels();
+      size_t size = Bus::PixelsSize();
+
+      memcpy(unlimitedPixels, pixels, size);
+
+      for (size_t i = 0; i < size; i++) {
+        pixels[i] = (pixels[i] * scale) >> 8;
+      }
+
+      metrics.framesLimited++;
+      Bus::Show();
+
+      // Restore the unscaled colors without marking the strip dirty
+      memcpy(Bus::Pixels(), unlimitedPixels, size);
+    }
+
+    // Rebuild the channel sum from the pixel buffer
+    void RecomputeChannelSum() {
+      uint8_t * pixels = Bus::Pixels();
+      size_t size = Bus::PixelsSize();
+      uint32_t sum = 0;
+
+      for (size_t i = 0; i < size; i++) {
+        sum += pixels[i];
+      }
+
+      channelSum = sum;
+    }
+
+    // Pixel used as the status LED
+    void SetStatusPixel(uint16_t indexPixel) {
+      statusPixel = indexPixel;
+    }
+
+    // Set the status LED color. Safe to call from any task.
+    void SetStatusColor(const RgbColor& color) {
+      statusColor.store(STATUS_SET | (color.R << 16) | (color.G << 8) | color.B);
+    }
+
+    // Counters for reporting how often limiting kicked in
+    const powerMetrics& GetPowerMetrics() const {
+      return metrics;
+    }
+
+  private:
+    static const uint32_t STATUS_SET = 1UL << 24; // statusColor has been set
+
+    uint32_t channelSum;        // sum of every channel of every pixel
+    uint8_t * unlimitedPixels;  // copy of the frame before limiting
+    uint16_t statusPixel;       // index of the status LED
+    std::atomic<uint32_t> statusColor; // STATUS_SET | 0xRRGGBB, or 0 if never set
+    powerMetrics metrics;
+
+    // Copy the requested status color into the frame, if it changed
+    void drawStatusColor() {
+      uint32_t status = statusColor.load();
+
+      if (!(status & STATUS_SET))
+        return;
+
+      RgbColor color((status >> 16) & 0xFF, (status >> 8) & 0xFF, status & 0xFF);
+
+      if (Bus::GetPixelColor(statusPixel) != color)
+        SetPixelColor(statusPixel, color);
+    }
+
+    static uint16_t channelTotal(const RgbColor& color) {
+      return color.R + color.G + color.B;
+    }
+};
+
+#endif
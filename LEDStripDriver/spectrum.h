@@ -0,0 +1,162 @@
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+/**
+ * Multi-band spectrum renderer for the audio extension.
+ *
+ * Each of the 8 bands is given a segment of the layout, either laid
+ * out along the strip or growing out from its centre (see
+ * SPECTRUM_FROM_CENTRE). Every frame:
+ *  - the target level of each band is interpolated between the last
+ *    two ESPNow updates, so bars move at the render frame rate rather
+ *    than at the update rate
+ *  - levels rise and fall towards the target with separate attack
+ *    and release rates
+ *  - a peak marker holds at the highest recent level, then decays
+ *  - the strip is drawn in one pass over precomputed lookup tables
+ */
+
+#include "Arduino.h"
+
+#include "animationFunctionHelpers.h"
+#include "espnow.h"
+#include "config.h"
+
+#define SPECTRUM_BANDS 8
+
+// Band of each logical pixel, and the range of its band's segment
+// (0 - 256) it covers. A pixel covers the steps above spectrumStep up
+// to and including spectrumStepEnd, and the ranges of neighbouring
+// pixels meet, so every level falls on exactly one pixel.
+uint8_t  spectrumBand[MAPPED_PIXEL_COUNT];
+uint16_t spectrumStep[MAPPED_PIXEL_COUNT];
+uint16_t spectrumStepEnd[MAPPED_PIXEL_COUNT];
+
+// Color of each band
+RgbColor spectrumColors[SPECTRUM_BANDS];
+
+/**
+ * Smoothed state of a single band. Levels range from 0 to 1.
+ */
+struct spectrumBandState {
+  float level;            // smoothed level
+  float peak;             // peak marker level
+  unsigned long peakTime; // millis() when the peak was set
+};
+
+spectrumBandState spectrumState[SPECTRUM_BANDS];
+
+/**
+ * Precompute which band and segment position each pixel shows
+ */
+void initSpectrum() {
+  uint16_t span = SPECTRUM_FROM_CENTRE ? maxPixelDistance + 1 : mapLength;
+
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    uint16_t coordinate = SPECTRUM_FROM_CENTRE ? pixelDistance[pixel] : pixelPosition[pixel];
+    uint32_t scaled = (uint32_t) coordinate * SPECTRUM_BANDS;
+    uint32_t offset = scaled % span;
+
+    spectrumBand[pixel] = scaled / span;
+
+    // The first pixel of a band starts at the bottom of its segment,
+    // and the last one ends at the top
+    spectrumStep[pixel] = (offset < SPECTRUM_BANDS) ? 0 : offset * 256 / span;
+    spectrumStepEnd[pixel] = min((offset + SPECTRUM_BANDS) * 256 / span, (uint32_t) 256);
+  }
+
+  // Bass in red through to treble in blue
+  for (uint8_t band = 0; band < SPECTRUM_BANDS; band++) {
+    spectrumColors[band] = HslColor(band * 0.66f / (SPECTRUM_BANDS - 1), 1.0f, 0.25f);
+    spectrumState[band] = { 0, 0, 0 };
+  }
+}
+
+/**
+ * Target level of every band, interpolated between the last two
+ * updates from the audio extension
+ */
+void getSpectrumTargets(float *targets) {
+  audioBandsMessage previous, current;
+  unsigned long received, interval;
+
+  portENTER_CRITICAL(&audioBandsMux);
+  previous = previousAudioBands;
+  current = currentAudioBands;
+  received = audioBandsReceived;
+  interval = audioBandsInterval;
+  portEXIT_CRITICAL(&audioBandsMux);
+
+  unsigned long age = millis() - received;
+
+  // Fall silent if the extension stops sending
+  if (received == 0 || age > SPECTRUM_TIMEOUT) {
+    for (uint8_t band = 0; band < SPECTRUM_BANDS; band++)
+      targets[band] = 0;
+
+    return;
+  }
+
+  float progress = min(1.0f, (float) age / interval);
+
+  for (uint8_t band = 0; band < SPECTRUM_BANDS; band++) {
+    float from = previous.bands[band];
+    float to = current.bands[band];
+
+    targets[band] = constrain((from + (to - from) * progress) / SPECTRUM_MAX_LEVEL, 0.0f, 1.0f);
+  }
+}
+
+/**
+ * Advance the smoothed levels and peak markers by one frame
+ */
+void updateSpectrum() {
+  float targets[SPECTRUM_BANDS];
+  getSpectrumTargets(targets);
+
+  unsigned long now = millis();
+
+  for (uint8_t band = 0; band < SPECTRUM_BANDS; band++) {
+    spectrumBandState &state = spectrumState[band];
+    float rate = targets[band] > state.level ? SPECTRUM_ATTACK : SPECTRUM_RELEASE;
+
+    state.level += (targets[band] - state.level) * rate;
+
+    if (state.level >= state.peak) {
+      state.peak = state.level;
+      state.peakTime = now;
+    } else if (now - state.peakTime > SPECTRUM_PEAK_HOLD) {
+      state.peak = max(state.level, state.peak - SPECTRUM_PEAK_DECAY);
+    }
+  }
+}
+
+/**
+ * Draw the current levels and peak markers to the strip
+ */
+void drawSpectrum() {
+  uint16_t levelSteps[SPECTRUM_BANDS];
+  uint16_t peakSteps[SPECTRUM_BANDS];
+
+  for (uint8_t band = 0; band < SPECTRUM_BANDS; band++) {
+    levelSteps[band] = spectrumState[band].level * 256;
+    peakSteps[band] = spectrumState[band].peak * 256;
+  }
+
+  for (uint16_t pixel = 0; pixel < MAPPED_PIXEL_COUNT; pixel++) {
+    uint8_t band = spectrumBand[pixel];
+    uint16_t step = spectrumStep[pixel];
+    RgbColor color = black;
+
+    if (step < levelSteps[band])
+      color = spectrumColors[band];
+
+    // The peak marker sits on the pixel whose range holds the peak level
+    if (step < peakSteps[band] && peakSteps[band] <= spectrumStepEnd[pixel])
+      color = white;
+
+    strip.SetPixelColor(pixelIndex[pixel], color);
+  }
+}
+
+#endif